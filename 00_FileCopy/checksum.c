@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <nmmintrin.h>
+#include "filecpy.h"
+
+#define CRC32C_POLY (0x82F63B78)
+#define XXH_PRIME1 (0x9E3779B185EBCA87ULL)
+#define XXH_PRIME2 (0xC2B2AE3D27D4EB4FULL)
+#define XXH_PRIME3 (0x165667B19E3779F9ULL)
+#define XXH_PRIME4 (0x85EBCA77C2B2AE63ULL)
+#define XXH_PRIME5 (0x27D4EB2F165667C5ULL)
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static const char   *checksum_names[CHECKSUM_COUNT] = {"none", "crc32c", "xxh64"};
+
+/* Slice-by-8 tables for the CPUs without the SSE4.2 crc32 instruction */
+static uint32_t     crc32c_table[8][256];
+static int          crc32c_hw;
+static pthread_once_t   crc32c_once = PTHREAD_ONCE_INIT;
+
+const char          *checksum_name(t_checksum_id id)
+{
+    return checksum_names[id];
+}
+
+/**
+ * Returns the checksum matching `name`, or CHECKSUM_COUNT if there is none
+ */
+t_checksum_id       checksum_from_name(const char *name)
+{
+    t_checksum_id   id;
+
+    for (id = CHECKSUM_NONE ; id < CHECKSUM_COUNT ; ++id)
+        if (strcmp(checksum_names[id], name) == 0)
+            break;
+    return id;
+}
+
+static void         crc32c_setup(void)
+{
+    uint32_t        crc;
+    unsigned        i, j;
+
+    if ((crc32c_hw = __builtin_cpu_supports("sse4.2")))
+        return;
+    for (i = 0 ; i < 256 ; ++i)
+    {
+        crc = i;
+        for (j = 0 ; j < 8 ; ++j)
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0 ; i < 256 ; ++i)
+        for (j = 1 ; j < 8 ; ++j)
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+}
+
+static uint32_t     crc32c_sw(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t        word;
+
+    for (; len >= 8 ; len -= 8, data += 8)
+    {
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF]
+            ^ crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF]
+            ^ crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF]
+            ^ crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+    }
+    while (len-- > 0)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t     crc32c_hw_update(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t        crc64 = crc, word;
+
+    for (; len >= 8 ; len -= 8, data += 8)
+    {
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+static uint64_t     xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = ROTL64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static uint64_t     xxh64_merge(uint64_t hash, uint64_t acc)
+{
+    hash ^= xxh64_round(0, acc);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/**
+ * Consume whole 32 bytes stripes, returns the number of bytes used
+ */
+static size_t       xxh64_stripes(t_checksum *sum, const unsigned char *data, size_t len)
+{
+    uint64_t        lane;
+    size_t          done, i;
+
+    for (done = 0 ; done + 32 <= len ; done += 32)
+        for (i = 0 ; i < 4 ; ++i)
+        {
+            memcpy(&lane, data + done + i * 8, sizeof(lane));
+            sum->acc[i] = xxh64_round(sum->acc[i], lane);
+        }
+    return done;
+}
+
+/**
+ * Start a new digest, the hardware CRC32C is picked if the CPU has it
+ */
+void                checksum_init(t_checksum *sum, t_checksum_id id)
+{
+    memset(sum, 0, sizeof(*sum));
+    sum->id = id;
+    if (id == CHECKSUM_CRC32C)
+        pthread_once(&crc32c_once, crc32c_setup);
+    sum->crc = 0xFFFFFFFF;
+    sum->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+    sum->acc[1] = XXH_PRIME2;
+    sum->acc[2] = 0;
+    sum->acc[3] = -XXH_PRIME1;
+}
+
+/**
+ * Add `len` bytes of data to the digest
+ */
+void                checksum_update(t_checksum *sum, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    size_t              used;
+
+    if (sum->id == CHECKSUM_CRC32C)
+        sum->crc = crc32c_hw ? crc32c_hw_update(sum->crc, bytes, len) : crc32c_sw(sum->crc, bytes, len);
+    if (sum->id != CHECKSUM_XXH64)
+        return;
+    sum->total += len;
+    if (sum->pending > 0)
+    {
+        used = 32 - sum->pending < len ? 32 - sum->pending : len;
+        memcpy(sum->stripe + sum->pending, bytes, used);
+        sum->pending += used;
+        bytes += used;
+        len -= used;
+        if (sum->pending < 32)
+            return;
+        xxh64_stripes(sum, sum->stripe, 32);
+        sum->pending = 0;
+    }
+    used = xxh64_stripes(sum, bytes, len);
+    memcpy(sum->stripe, bytes + used, len - used);
+    sum->pending = len - used;
+}
+
+/**
+ * Add `len` zero bytes (a hole) to the digest
+ */
+void                checksum_zeros(t_checksum *sum, size_t len)
+{
+    static const char   zeros[64 << 10];
+
+    for (; sum->id != CHECKSUM_NONE && len > 0 ; len -= (len < sizeof(zeros) ? len : sizeof(zeros)))
+        checksum_update(sum, zeros, len < sizeof(zeros) ? len : sizeof(zeros));
+}
+
+/**
+ * Finish the digest
+ */
+uint64_t            checksum_final(const t_checksum *sum)
+{
+    uint64_t        hash, lane;
+    uint32_t        half;
+    size_t          i = 0;
+
+    if (sum->id == CHECKSUM_CRC32C)
+        return sum->crc ^ 0xFFFFFFFF;
+    if (sum->id != CHECKSUM_XXH64)
+        return 0;
+    if (sum->total >= 32)
+    {
+        hash = ROTL64(sum->acc[0], 1) + ROTL64(sum->acc[1], 7) + ROTL64(sum->acc[2], 12) + ROTL64(sum->acc[3], 18);
+        for (i = 0 ; i < 4 ; ++i)
+            hash = xxh64_merge(hash, sum->acc[i]);
+    }
+    else
+        hash = XXH_PRIME5;
+    hash += sum->total;
+    for (i = 0 ; i + 8 <= sum->pending ; i += 8)
+    {
+        memcpy(&lane, sum->stripe + i, sizeof(lane));
+        hash ^= xxh64_round(0, lane);
+        hash = ROTL64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (i + 4 <= sum->pending)
+    {
+        memcpy(&half, sum->stripe + i, sizeof(half));
+        hash ^= (uint64_t)half * XXH_PRIME1;
+        hash = ROTL64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        i += 4;
+    }
+    for (; i < sum->pending ; ++i)
+    {
+        hash ^= sum->stripe[i] * XXH_PRIME5;
+        hash = ROTL64(hash, 11) * XXH_PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Format the digest as hexadecimal into `str` (at least 17 bytes)
+ */
+const char          *checksum_format(const t_checksum *sum, char *str)
+{
+    sprintf(str, sum->id == CHECKSUM_CRC32C ? "%08llx" : "%016llx", (unsigned long long)checksum_final(sum));
+    return str;
+}
+
+/**
+ * Read back `outfile` from the storage and compare its digest with the
+ * one computed during the copy. O_DIRECT makes sure we don't just read
+ * our own writes from the page cache; on filesystems refusing it (tmpfs)
+ * the cached pages are dropped first instead.
+ */
+int                 verify_file(t_copy_ctx *ctx, const char *outfile)
+{
+    t_checksum      sum;
+    char            expected[32], actual[32];
+    size_t          len = ctx->buffer_size & ~(size_t)(DIRECT_ALIGN - 1);
+    ssize_t         n;
+    int             fd;
+
+    checksum_init(&sum, ctx->sum.id);
+    if (len == 0 || (fd = open(outfile, O_RDONLY | O_DIRECT)) == SYSCALL_ERROR)
+    {
+        len = ctx->buffer_size;
+        if ((errno != EINVAL && len >= DIRECT_ALIGN) || (fd = open(outfile, O_RDONLY)) == SYSCALL_ERROR)
+        {
+            fprintf(stderr, "[-] Failed to open %s for verification\n", outfile);
+            perror("open");
+            return RETURN_ERROR;
+        }
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    while ((n = read(fd, ctx->buffer, len)) > 0)
+        checksum_update(&sum, ctx->buffer, n);
+    close(fd);
+    if (n == SYSCALL_ERROR)
+    {
+        fprintf(stderr, "[-] Failed to read %s for verification\n", outfile);
+        perror("read");
+        return RETURN_ERROR;
+    }
+    if (checksum_final(&sum) != checksum_final(&ctx->sum))
+    {
+        fprintf(stderr, "[-] Verification failed for %s: %s %s, expected %s\n", outfile, checksum_name(sum.id),
+                checksum_format(&sum, actual), checksum_format(&ctx->sum, expected));
+        return RETURN_ERROR;
+    }
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,124 @@
+#!/bin/bash
+# Compilation script
+#
+#   ./compile.sh                build filecpy
+#   ./compile.sh cachebench     page cache pollution of the copy modes
+#   ./compile.sh bench [csv|json]   throughput of every engine
+
+
+build()
+{
+    gcc *.c -o filecpy -O2 -Wall -Wextra -pthread
+    rm -rf *.o
+}
+
+# Drop the cached pages of the given files (POSIX_FADV_DONTNEED)
+drop_cache()
+{
+    python3 -c 'import os, sys
+for path in sys.argv[1:]:
+    fd = os.open(path, os.O_RDONLY); os.fsync(fd)
+    os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED); os.close(fd)' "$@"
+}
+
+# A "hot" file stands for the working set of another process: with a
+# uniform random reader its hit rate is the fraction left in the cache
+# after the copy of a big file. Run it where the page cache is the
+# bottleneck (BENCH_DIR on a disk, not tmpfs, BIG_SIZE/HOT_SIZE in MiB).
+cachebench()
+{
+    local dir="${BENCH_DIR:-/var/tmp}/filecpy.$$"
+    local mode
+
+    mkdir -p "$dir" || exit 1
+    trap "rm -rf '$dir'" EXIT
+    head -c "$(( ${HOT_SIZE:-256} << 20 ))" /dev/urandom > "$dir/hot"
+    head -c "$(( ${BIG_SIZE:-1024} << 20 ))" /dev/urandom > "$dir/big"
+    for mode in buffered --fadvise --direct
+    do
+        rm -f "$dir/out"
+        drop_cache "$dir/big"
+        cat "$dir/hot" > /dev/null
+        echo "== $mode"
+        if [ "$mode" = buffered ]; then
+            ./filecpy "$dir/big" "$dir/out" || exit 1
+        else
+            ./filecpy "$mode" "$dir/big" "$dir/out" || exit 1
+        fi
+        ./filecpy --residency "$dir/hot" "$dir/big" "$dir/out"
+        cmp "$dir/big" "$dir/out" || exit 1
+    done
+}
+
+# Create the input of one BENCH_SIZES entry: "tiny" and sizes under 64K
+# are a directory of BENCH_FILES files (copied with -r, for the latency
+# percentiles), "sparse" is a BENCH_SPARSE file with 1M of data every
+# 64M, anything else a single file of that size (4K, 1M, 1G...)
+bench_input()
+{
+    local path="$1" spec="$2" size i
+
+    case "$spec" in
+        sparse)
+            truncate -s "${BENCH_SPARSE:-1G}" "$path"
+            size=$(stat -c %s "$path")
+            for (( i = 0 ; i < size >> 20 ; i += 64 ))
+            do
+                head -c 1M /dev/urandom | dd of="$path" bs=1M seek=$i conv=notrunc status=none
+            done
+            return ;;
+        tiny) size=64 ;;
+        *)    size=$(numfmt --from=iec "$spec") || exit 1 ;;
+    esac
+    if (( size >= 65536 )); then
+        head -c "$size" /dev/urandom > "$path"
+        return
+    fi
+    mkdir -p "$path"
+    for (( i = 0 ; i < ${BENCH_FILES:-1000} ; ++i ))
+    do
+        head -c "$size" /dev/urandom > "$path/$i"
+    done
+}
+
+# Copy each BENCH_SIZES input with every engine (input in the page cache),
+# BENCH_RUNS times, and print one --stats record per run with its size
+bench()
+{
+    local format="${1:-csv}" dir="${BENCH_DIR:-/var/tmp}/filecpy.$$"
+    local spec engine run flags record header=1
+
+    mkdir -p "$dir" || exit 1
+    trap "rm -rf '$dir'" EXIT
+    for spec in ${BENCH_SIZES:-tiny 4K 1M 1G sparse}
+    do
+        bench_input "$dir/$spec" "$spec"
+        flags=()
+        [ -d "$dir/$spec" ] && flags=(-r)
+        for engine in ${BENCH_ENGINES:-auto copy_file_range sendfile splice readwrite mmap io_uring parallel sparse direct fadvise}
+        do
+            for (( run = 0 ; run < ${BENCH_RUNS:-3} ; ++run ))
+            do
+                rm -rf "$dir/out"
+                cat "$dir/$spec" > /dev/null 2>&1 || find "$dir/$spec" -type f -exec cat {} + > /dev/null
+                record=$(./filecpy "${flags[@]}" -e "$engine" --stats "$format" "$dir/$spec" "$dir/out" 2> /dev/null \
+                         | grep -v '^\[') || { echo "[-] $engine failed on $spec" >&2; continue; }
+                if [ "$format" = json ]; then
+                    echo "{\"size\": \"$spec\", \"run\": $run, ${record#\{}"
+                else
+                    (( header )) && echo "size,run,$(head -n 1 <<< "$record")"
+                    header=0
+                    echo "$spec,$run,$(tail -n 1 <<< "$record")"
+                fi
+            done
+        done
+        rm -rf "$dir/$spec" "$dir/out"
+    done
+}
+
+case "${1:-build}" in
+    build)      build ;;
+    cachebench) build && cachebench ;;
+    bench)      build && bench "$2" ;;
+    *)          echo "usage: $0 [build|cachebench|bench [csv|json]]" >&2; exit 1 ;;
+esac
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "filecpy.h"
+
+/**
+ * Add or remove O_DIRECT on fd, fails with EINVAL on filesystems without
+ * direct I/O support (tmpfs)
+ */
+static int  set_direct(int fd, int enable)
+{
+    int     flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) == SYSCALL_ERROR)
+        return SYSCALL_ERROR;
+    return fcntl(fd, F_SETFL, enable ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+/**
+ * Write the last block of the file, which is not a multiple of
+ * DIRECT_ALIGN: O_DIRECT would refuse it, so it goes through the page
+ * cache and its page is flushed and dropped right away.
+ */
+static int  write_tail(t_copy_ctx *ctx, const char *buffer, size_t len, off_t offset)
+{
+    ctx->syscalls += 4;
+    if (set_direct(ctx->outfd, 0) == SYSCALL_ERROR
+        || pwrite(ctx->outfd, buffer, len, offset) != (ssize_t)len
+        || fdatasync(ctx->outfd) == SYSCALL_ERROR)
+    {
+        perror("write_tail");
+        return RETURN_ERROR;
+    }
+    posix_fadvise(ctx->outfd, offset, len, POSIX_FADV_DONTNEED);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy with both fds in O_DIRECT mode, bypassing the page cache so a big
+ * copy doesn't evict the hot pages of the other processes. Offsets,
+ * sizes and the buffer have to be DIRECT_ALIGN aligned: the block size
+ * is rounded up, and only the unaligned tail is written buffered. A read
+ * too short to leave an aligned offset behind hands the rest over to the
+ * fallback engine.
+ */
+int         direct_engine(t_copy_ctx *ctx)
+{
+    off_t   in_off, out_off, end;
+    size_t  len, aligned;
+    ssize_t n, w;
+    int     ret = RETURN_SUCCESS;
+
+    if (file_range(ctx, &in_off, &out_off, &end) == ENGINE_UNSUPPORTED
+        || in_off % DIRECT_ALIGN != 0 || out_off % DIRECT_ALIGN != 0)
+        return ENGINE_UNSUPPORTED;
+    ctx->syscalls += 2;
+    if (set_direct(ctx->infd, 1) == SYSCALL_ERROR || set_direct(ctx->outfd, 1) == SYSCALL_ERROR)
+    {
+        set_direct(ctx->infd, 0);
+        return ENGINE_UNSUPPORTED;
+    }
+    ctx->io.block = (ctx->io.block + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    ctx->io.max = (ctx->io.max + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    if (ctx->io.block > ctx->io.max)
+        ctx->io.block = ctx->io.max;
+    /* A -b below DIRECT_ALIGN was rounded up past the buffer */
+    if (ctx->buffer_size < ctx->io.max)
+    {
+        free(ctx->buffer);
+        ctx->buffer_size = 0;
+        if ((ctx->buffer = iosize_alloc(&ctx->io)) == NULL)
+        {
+            set_direct(ctx->infd, 0);
+            set_direct(ctx->outfd, 0);
+            return RETURN_ERROR;
+        }
+        ctx->buffer_size = ctx->io.max;
+    }
+    while (ret == RETURN_SUCCESS && in_off < end)
+    {
+        ++ctx->syscalls;
+        if ((n = pread(ctx->infd, ctx->buffer, ctx->io.block, in_off)) <= 0)
+        {
+            if (n == SYSCALL_ERROR && errno == EINTR)
+                continue;
+            fprintf(stderr, "[-] O_DIRECT read failed at offset %lld\n", (long long)in_off);
+            ret = RETURN_ERROR;
+            break;
+        }
+        aligned = n & ~(ssize_t)(DIRECT_ALIGN - 1);
+        /* Less than DIRECT_ALIGN short of the end, the next engine carries on from in_off buffered */
+        if (aligned == 0 && in_off + n < end)
+        {
+            ret = ENGINE_UNSUPPORTED;
+            break;
+        }
+        for (len = 0 ; len < aligned ; len += w)
+        {
+            ++ctx->syscalls;
+            if ((w = pwrite(ctx->outfd, ctx->buffer + len, aligned - len, out_off + len)) <= 0)
+            {
+                perror("pwrite");
+                ret = RETURN_ERROR;
+                break;
+            }
+        }
+        /* A short read in the middle of the file is retried from its last aligned offset */
+        len = (in_off + n < end ? aligned : (size_t)n);
+        checksum_update(&ctx->sum, ctx->buffer, len);
+        if (ret == RETURN_SUCCESS && len > aligned)
+            ret = write_tail(ctx, ctx->buffer + aligned, len - aligned, out_off + aligned);
+        ctx->bytes += len;
+        in_off += len;
+        out_off += len;
+        iosize_update(&ctx->io, len);
+    }
+    set_direct(ctx->infd, 0);
+    set_direct(ctx->outfd, 0);
+    lseek(ctx->infd, in_off, SEEK_SET);
+    lseek(ctx->outfd, out_off, SEEK_SET);
+    return ret;
+}
+
+/**
+ * Drop [start, end) of the output from the cache once its writeback is
+ * done (POSIX_FADV_DONTNEED ignores dirty pages), and start the writeback
+ * of [end, next) so it's done by the next call.
+ */
+static void drop_written(t_copy_ctx *ctx, off_t start, off_t end, off_t next)
+{
+    ctx->syscalls += 3;
+    sync_file_range(ctx->outfd, start, end - start,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(ctx->outfd, start, end - start, POSIX_FADV_DONTNEED);
+    sync_file_range(ctx->outfd, end, next - end, SYNC_FILE_RANGE_WRITE);
+}
+
+/**
+ * Buffered copy which keeps its page cache footprint to about two
+ * FADVISE_WINDOW: what was read is dropped with POSIX_FADV_DONTNEED a
+ * window behind, and what was written once its writeback completed.
+ * Softer than O_DIRECT (the kernel still does readahead and write
+ * coalescing) and it works on every filesystem.
+ */
+int         fadvise_engine(t_copy_ctx *ctx)
+{
+    off_t   in_off, out_off, end, mark, out_start, in_start;
+    ssize_t n;
+
+    if (file_range(ctx, &in_off, &out_off, &end) == ENGINE_UNSUPPORTED)
+        return ENGINE_UNSUPPORTED;
+    ++ctx->syscalls;
+    posix_fadvise(ctx->infd, in_off, end - in_off, POSIX_FADV_SEQUENTIAL);
+    mark = out_start = out_off;
+    in_start = in_off;
+    while (in_off < end)
+    {
+        ++ctx->syscalls;
+        if ((n = pread(ctx->infd, ctx->buffer, ctx->io.block, in_off)) <= 0)
+        {
+            if (n == SYSCALL_ERROR && errno == EINTR)
+                continue;
+            fprintf(stderr, "[-] pread() failed at offset %lld\n", (long long)in_off);
+            return RETURN_ERROR;
+        }
+        checksum_update(&ctx->sum, ctx->buffer, n);
+        if (write_all(ctx, ctx->outfd, ctx->buffer, n) == RETURN_ERROR)
+            return RETURN_ERROR;
+        ctx->bytes += n;
+        in_off += n;
+        out_off += n;
+        iosize_update(&ctx->io, n);
+        if (out_off - mark >= FADVISE_WINDOW)
+        {
+            /* A window late, dropping pages still under readahead brings them back */
+            if (in_off - FADVISE_WINDOW > in_start)
+            {
+                ++ctx->syscalls;
+                posix_fadvise(ctx->infd, in_start, in_off - FADVISE_WINDOW - in_start, POSIX_FADV_DONTNEED);
+                in_start = in_off - FADVISE_WINDOW;
+            }
+            drop_written(ctx, out_start, mark, out_off);
+            out_start = mark;
+            mark = out_off;
+        }
+    }
+    ctx->syscalls += 3;
+    fdatasync(ctx->outfd);
+    posix_fadvise(ctx->outfd, out_start, out_off - out_start, POSIX_FADV_DONTNEED);
+    posix_fadvise(ctx->infd, in_start, 0, POSIX_FADV_DONTNEED);
+    lseek(ctx->infd, in_off, SEEK_SET);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Print which fraction of `path` is in the page cache (mincore()), to
+ * measure the cache pollution of a copy or what is left of another
+ * process' working set
+ */
+int         print_residency(const char *path)
+{
+    struct stat     st;
+    unsigned char   *vec;
+    size_t          page = sysconf(_SC_PAGESIZE), pages, resident = 0, i;
+    void            *map;
+    int             fd;
+
+    if ((fd = open(path, O_RDONLY)) == SYSCALL_ERROR || fstat(fd, &st) == SYSCALL_ERROR)
+    {
+        fprintf(stderr, "[-] Failed to open %s\n", path);
+        perror("open");
+        return RETURN_ERROR;
+    }
+    pages = (st.st_size + page - 1) / page;
+    if (pages > 0)
+    {
+        if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED
+            || (vec = malloc(pages)) == NULL || mincore(map, st.st_size, vec) == SYSCALL_ERROR)
+        {
+            perror("mincore");
+            close(fd);
+            return RETURN_ERROR;
+        }
+        for (i = 0 ; i < pages ; ++i)
+            resident += vec[i] & 1;
+        free(vec);
+        munmap(map, st.st_size);
+    }
+    close(fd);
+    printf("%s: %zu/%zu pages resident (%.1f%%)\n", path, resident, pages,
+           pages > 0 ? 100.0 * resident / pages : 0.0);
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "filecpy.h"
+
+#define PIPE_SIZE (1 << 20)
+
+/**
+ * errno values meaning "this engine can't handle these fds", not a real I/O error
+ */
+static int  engine_unsupported_errno(int err)
+{
+    return (err == ENOSYS || err == EXDEV || err == EINVAL
+            || err == EOPNOTSUPP || err == EBADF || err == ESPIPE);
+}
+
+/**
+ * Copy with copy_file_range(), the data never leaves the kernel and
+ * some filesystems (btrfs, xfs, nfs) can even share the extents
+ */
+static int  copy_file_range_engine(t_copy_ctx *ctx)
+{
+    ssize_t n;
+    int     first = 1;
+
+    while ((n = copy_file_range(ctx->infd, NULL, ctx->outfd, NULL, ENGINE_CHUNK, 0)) > 0)
+    {
+        ctx->bytes += n;
+        ++ctx->syscalls;
+        first = 0;
+    }
+    ++ctx->syscalls;
+    /**
+     * Pseudo filesystems (procfs, sysfs) report a size of 0 and copy_file_range()
+     * returns 0 right away, let the next engine find out if the file is really empty
+     */
+    if (n == 0 && first)
+        return ENGINE_UNSUPPORTED;
+    if (n == SYSCALL_ERROR)
+    {
+        if (engine_unsupported_errno(errno))
+            return ENGINE_UNSUPPORTED;
+        perror("copy_file_range");
+        return RETURN_ERROR;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy with sendfile(), the input has to be mmap()-able (regular file)
+ */
+static int  sendfile_engine(t_copy_ctx *ctx)
+{
+    ssize_t n;
+
+    while ((n = sendfile(ctx->outfd, ctx->infd, NULL, ENGINE_CHUNK)) > 0)
+    {
+        ctx->bytes += n;
+        ++ctx->syscalls;
+    }
+    ++ctx->syscalls;
+    if (n == SYSCALL_ERROR)
+    {
+        if (engine_unsupported_errno(errno))
+            return ENGINE_UNSUPPORTED;
+        perror("sendfile");
+        return RETURN_ERROR;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Write back `len` bytes stuck in the pipe when the output refuses splice()
+ */
+static int  drain_pipe(t_copy_ctx *ctx, int pipefd, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        ++ctx->syscalls;
+        if ((n = read(pipefd, ctx->buffer, len < ctx->io.block ? len : ctx->io.block)) <= 0
+            || write_all(ctx, ctx->outfd, ctx->buffer, n) == RETURN_ERROR)
+        {
+            perror("drain_pipe");
+            return RETURN_ERROR;
+        }
+        ctx->bytes += n;
+        len -= n;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Move one pipe worth of data (`len` bytes) from the pipe to the output
+ */
+static int  splice_out(t_copy_ctx *ctx, int pipefd, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        ++ctx->syscalls;
+        if ((n = splice(pipefd, NULL, ctx->outfd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0)
+        {
+            if (n == SYSCALL_ERROR && engine_unsupported_errno(errno))
+                return drain_pipe(ctx, pipefd, len) == RETURN_SUCCESS ? ENGINE_UNSUPPORTED : RETURN_ERROR;
+            perror("splice");
+            return RETURN_ERROR;
+        }
+        ctx->bytes += n;
+        len -= n;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy with splice() through an intermediate pipe, works for almost every
+ * kind of fd (sockets, pipes, regular files) as long as the kernel supports it
+ */
+static int  splice_engine(t_copy_ctx *ctx)
+{
+    int     pipefd[2];
+    ssize_t n;
+    size_t  pipe_size;
+    int     ret = RETURN_SUCCESS;
+
+    if (pipe2(pipefd, O_CLOEXEC) == SYSCALL_ERROR)
+        return ENGINE_UNSUPPORTED;
+    /* A bigger pipe means fewer splice() calls, the default is 64 KiB */
+    if (fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_SIZE) == SYSCALL_ERROR)
+        pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    else
+        pipe_size = PIPE_SIZE;
+    while (1)
+    {
+        ++ctx->syscalls;
+        if ((n = splice(ctx->infd, NULL, pipefd[1], NULL, pipe_size, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0)
+            break;
+        if ((ret = splice_out(ctx, pipefd[0], n)) != RETURN_SUCCESS)
+            break;
+    }
+    if (n == SYSCALL_ERROR)
+    {
+        if (engine_unsupported_errno(errno))
+            ret = ENGINE_UNSUPPORTED;
+        else
+        {
+            perror("splice");
+            ret = RETURN_ERROR;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ret;
+}
+
+/**
+ * Write the whole `len` bytes of buffer to fd, write() may be partial
+ */
+int         write_all(t_copy_ctx *ctx, int fd, const char *buffer, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        ++ctx->syscalls;
+        if ((n = write(fd, buffer, len)) == SYSCALL_ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "[-] Failed to write()\n");
+            perror("write");
+            return RETURN_ERROR;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Read from the intfd then write the readed content to outfd
+ */
+static int  readwrite_engine(t_copy_ctx *ctx)
+{
+    ssize_t byte_read;
+
+    /**
+     * Reading the input file with the read() syscall, then write the content to 
+     * the output file with the write() syscall, ctx->io.block bytes at a time.
+     */
+    while((byte_read = read(ctx->infd, ctx->buffer, ctx->io.block)) > 0)
+    {
+        ++ctx->syscalls;
+        checksum_update(&ctx->sum, ctx->buffer, byte_read);
+        if (write_all(ctx, ctx->outfd, ctx->buffer, byte_read) == RETURN_ERROR)
+            return RETURN_ERROR;
+        ctx->bytes += byte_read;
+        iosize_update(&ctx->io, byte_read);
+    }
+    ++ctx->syscalls;
+
+    /**
+     * If the read() system call failed, we should know it
+     */
+    if (byte_read == SYSCALL_ERROR)
+    {
+        fprintf(stderr, "[-] An error occured while reading data\n");
+        perror("read");
+        return RETURN_ERROR;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Fetch the range left to copy for the engines using explicit offsets:
+ * [*in_off, *end) of the input goes to *out_off in the output.
+ * Only regular files whose st_size can be trusted are supported, pseudo
+ * files (procfs, sysfs) have more data than their st_size.
+ */
+int         file_range(t_copy_ctx *ctx, off_t *in_off, off_t *out_off, off_t *end)
+{
+    struct stat st;
+
+    if (fstat(ctx->infd, &st) == SYSCALL_ERROR || !S_ISREG(st.st_mode)
+        || (*in_off = lseek(ctx->infd, 0, SEEK_CUR)) == SYSCALL_ERROR
+        || (*out_off = lseek(ctx->outfd, 0, SEEK_CUR)) == SYSCALL_ERROR)
+        return ENGINE_UNSUPPORTED;
+    *end = st.st_size > *in_off ? st.st_size : *in_off;
+    if (pread(ctx->infd, ctx->buffer, 1, *end) > 0)
+        return ENGINE_UNSUPPORTED;
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Engines table, indexed by t_engine_id, ENGINE_AUTO walks it in order
+ */
+static const t_engine   engines[ENGINE_COUNT] =
+{
+    [ENGINE_AUTO] = {"auto", NULL, ENGINE_AUTO, 0},
+    [ENGINE_COPY_FILE_RANGE] = {"copy_file_range", copy_file_range_engine, ENGINE_AUTO, 0},
+    [ENGINE_SENDFILE] = {"sendfile", sendfile_engine, ENGINE_AUTO, 0},
+    [ENGINE_SPLICE] = {"splice", splice_engine, ENGINE_AUTO, 0},
+    [ENGINE_READWRITE] = {"readwrite", readwrite_engine, ENGINE_AUTO, 1},
+    [ENGINE_MMAP] = {"mmap", mmap_engine, ENGINE_AUTO, 1},
+    [ENGINE_URING] = {"io_uring", uring_engine, ENGINE_READWRITE, 0},
+    [ENGINE_PARALLEL] = {"parallel", parallel_engine, ENGINE_READWRITE, 0},
+    [ENGINE_SPARSE] = {"sparse", sparse_engine, ENGINE_READWRITE, 1},
+    [ENGINE_DIRECT] = {"direct", direct_engine, ENGINE_FADVISE, 1},
+    [ENGINE_FADVISE] = {"fadvise", fadvise_engine, ENGINE_READWRITE, 1},
+};
+
+const t_engine  *engine_get(t_engine_id id)
+{
+    return &engines[id];
+}
+
+/**
+ * Returns the engine matching `name`, or ENGINE_COUNT if there is none
+ */
+t_engine_id     engine_from_name(const char *name)
+{
+    t_engine_id id;
+
+    for (id = ENGINE_AUTO ; id < ENGINE_COUNT ; ++id)
+        if (strcmp(engines[id].name, name) == 0)
+            break;
+    return id;
+}
+
+/**
+ * Copy ctx->infd to ctx->outfd with the given engine.
+ *
+ * With ENGINE_AUTO every engine is tried in order: they all use the fds
+ * current offsets, so an engine giving up half way is simply continued
+ * by the next one. A forced engine which is not supported is replaced
+ * by its fallback engine, or is an error if it has none.
+ */
+int             copy_files(t_copy_ctx *ctx, t_engine_id engine)
+{
+    t_engine_id id = (engine == ENGINE_AUTO ? ENGINE_AUTO + 1 : engine);
+    int         ret;
+
+    for (; id < ENGINE_COUNT ; ++id)
+    {
+        ctx->used = id;
+        if ((ret = engines[id].copy(ctx)) != ENGINE_UNSUPPORTED)
+            return ret;
+        if (engine != ENGINE_AUTO && engines[id].fallback != ENGINE_AUTO)
+        {
+            fprintf(stderr, "[~] Engine %s is not available, falling back to %s\n",
+                    engines[id].name, engines[engines[id].fallback].name);
+            return copy_files(ctx, engines[id].fallback);
+        }
+        if (engine != ENGINE_AUTO)
+        {
+            fprintf(stderr, "[-] Engine %s is not supported for these files\n", engines[id].name);
+            return RETURN_ERROR;
+        }
+    }
+    return RETURN_ERROR;
+}
@@ -1,15 +1,12 @@
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-
-#define RETURN_SUCCESS (0)
-#define RETURN_ERROR (1)
-#define SYSCALL_ERROR (-1)
-#define MAX_BYTE_READ (4096)
-#define OUTFILE_PERMS (S_IRWXU | S_IRGRP | S_IROTH)
-#define OUTFILE_MODE (O_CREAT | O_WRONLY | O_TRUNC)
+#include "filecpy.h"
 
 /**
  * Function used to close two file descriptors infd and outfd
@@ -22,11 +19,11 @@ void        close_files(int infd, int outfd)
 
 /**
  * Function used to open infile and outfile then store the file descriptors
- * into infd and outfd
+ * into infd and outfd, outfile is opened with the `outmode` flags
  *
  * In case of error, a message will be displayed and the function will returns RETURN_ERROR
  */
-int         open_files(const char *infile, const char *outfile, int *infd, int *outfd)
+int         open_files(const char *infile, const char *outfile, int outmode, int *infd, int *outfd)
 {
     /**
      * Opening the input file (read only)
@@ -43,51 +40,217 @@ int         open_files(const char *infile, const char *outfile, int *infd, int *
      *  - Create it if it is not exists (grant all permission for the current user "-rwx------")
      *  - Trunc the file if it exists
      */
-    if ((*outfd = open(outfile, OUTFILE_MODE, OUTFILE_PERMS)) == SYSCALL_ERROR)
+    if ((*outfd = open(outfile, outmode, OUTFILE_PERMS)) == SYSCALL_ERROR)
     {
         fprintf(stderr, "[-] Failed to open output file: %s\n", outfile);
         perror("open");
+        close(*infd);
         return RETURN_ERROR;
     }
     return RETURN_SUCCESS; 
 }
 
 /**
- * Read from the intfd then write the readed content to outfd
+ * Copy infile to outfile with the engine and settings of ctx.
+ * ctx->buffer is kept (and grown if needed) for the next file.
  */
-int copy_files(int infd, int outfd)
+int         copy_file(t_copy_ctx *ctx, const char *infile, const char *outfile)
 {
-    char    buffer[MAX_BYTE_READ];
-    int     byte_read;
+    t_engine_id engine = ctx->engine;
+    double      start = clock_seconds();
+    int         ret;
 
-    /**
-     * Reading the input file with the read() syscall, then write the content to 
-     * the output file with the write() syscall.
-     * Placing a \0 at the end of the buffer each time we call read to avoid memory corruption 
-     * (only if the buffer would be used for an other purpose like (strlen, printf, strcpy))
-     */
-    while((byte_read = read(infd, buffer, MAX_BYTE_READ)) > 0)
+    if (open_files(infile, outfile, ctx->mmap_output ? OUTFILE_MODE_RW : OUTFILE_MODE,
+                   &ctx->infd, &ctx->outfd) == RETURN_ERROR)
+        return RETURN_ERROR;
+    iosize_init(&ctx->io, ctx->infd, ctx->outfd, ctx->block);
+    if (ctx->buffer_size < ctx->io.max)
     {
-        buffer[byte_read] = 0;
-        if (write(outfd, buffer, byte_read) == SYSCALL_ERROR)
+        free(ctx->buffer);
+        ctx->buffer_size = 0;
+        if ((ctx->buffer = iosize_alloc(&ctx->io)) == NULL)
         {
-            fprintf(stderr, "[-] Failed to write()\n");
-            perror("write");
+            close_files(ctx->infd, ctx->outfd);
             return RETURN_ERROR;
         }
+        ctx->buffer_size = ctx->io.max;
+    }
+    if (engine == ENGINE_AUTO && (ctx->sparse == SPARSE_ALWAYS
+                                  || (ctx->sparse == SPARSE_AUTO && is_sparse(ctx->infd))))
+        engine = ENGINE_SPARSE;
+    /* The digest is computed on the way, only some engines see the data */
+    checksum_init(&ctx->sum, ctx->sum.id);
+    if (ctx->sum.id != CHECKSUM_NONE && !engine_get(engine)->inline_data)
+    {
+        if (engine != ENGINE_AUTO)
+            fprintf(stderr, "[~] Engine %s does not read the data, using readwrite for the checksum\n",
+                    engine_get(engine)->name);
+        engine = ENGINE_READWRITE;
     }
+    ret = copy_files(ctx, engine);
+    // closing file descriptors
+    close_files(ctx->infd, ctx->outfd);
+    if (ret == RETURN_SUCCESS && ctx->verify)
+        ret = verify_file(ctx, outfile);
+    if (ret == RETURN_SUCCESS && ctx->stats != STATS_NONE)
+        stats_record(ctx, clock_seconds() - start);
+    return ret;
+}
 
-    /**
-     * If the read() system call failed, we should know it
-     */
-    if (byte_read == SYSCALL_ERROR)
+/**
+ * Command line options
+ */
+static const struct option  long_options[] =
+{
+    {"engine", required_argument, NULL, 'e'},
+    {"block-size", required_argument, NULL, 'b'},
+    {"mmap", no_argument, NULL, 'm'},
+    {"mmap-output", no_argument, NULL, 'M'},
+    {"queue-depth", required_argument, NULL, 'q'},
+    {"buffers", required_argument, NULL, 'n'},
+    {"threads", required_argument, NULL, 'j'},
+    {"chunk-size", required_argument, NULL, 'c'},
+    {"sparse", required_argument, NULL, 's'},
+    {"zero-detect", no_argument, NULL, 'z'},
+    {"recursive", no_argument, NULL, 'r'},
+    {"manifest", required_argument, NULL, 'f'},
+    {"checksum", required_argument, NULL, 'k'},
+    {"verify", no_argument, NULL, 'V'},
+    {"direct", no_argument, NULL, 'D'},
+    {"fadvise", no_argument, NULL, 'F'},
+    {"residency", no_argument, NULL, 'R'},
+    {"stats", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0}
+};
+
+static const char   *sparse_modes[] = {"auto", "always", "never", NULL};
+
+/**
+ * Display the usage on stderr
+ */
+static void usage(const char *name)
+{
+    fprintf(stderr, "[+] Usage: %s [options] <input file> <output file>\n", name);
+    fprintf(stderr, "           %s [options] -r <input directory> <output directory>\n", name);
+    fprintf(stderr, "           %s [options] --manifest <list> [<output directory>]\n", name);
+    fprintf(stderr, "           %s --residency <file>...\n", name);
+    fprintf(stderr, "    -e, --engine      auto, copy_file_range, sendfile, splice, readwrite,\n"
+                    "                      mmap, io_uring, parallel, sparse, direct, fadvise (default: auto)\n");
+    fprintf(stderr, "    -b, --block-size  buffer size, e.g. 1M (default: adaptive, from st_blksize)\n");
+    fprintf(stderr, "    --mmap            same as --engine mmap\n");
+    fprintf(stderr, "    --mmap-output     mmap engine, mapping the output as well\n");
+    fprintf(stderr, "    --direct          same as --engine direct: O_DIRECT, bypass the page cache\n");
+    fprintf(stderr, "    --fadvise         same as --engine fadvise: drop the copied pages from the cache\n");
+    fprintf(stderr, "    --queue-depth N   io_uring requests in flight (default: %d)\n", URING_DEPTH);
+    fprintf(stderr, "    --buffers N       io_uring buffers (default: queue depth)\n");
+    fprintf(stderr, "    -j, --threads N   parallel engine and tree copy threads (default: online CPUs)\n");
+    fprintf(stderr, "    --chunk-size SIZE parallel engine range size (default: %dM)\n", PARALLEL_CHUNK >> 20);
+    fprintf(stderr, "    --sparse WHEN     auto, always, never: copy hole by hole (default: auto, if the input is sparse)\n");
+    fprintf(stderr, "    -z, --zero-detect sparse engine, also leaving zero filled blocks as holes\n");
+    fprintf(stderr, "    -r, --recursive   copy a whole directory tree\n");
+    fprintf(stderr, "    -f, --manifest F  copy the files listed in F, one \"<input>[TAB<output>]\" per line\n");
+    fprintf(stderr, "    -k, --checksum A  crc32c or xxh64 digest computed during the copy\n");
+    fprintf(stderr, "    --verify          read the output back with O_DIRECT and compare digests (default: crc32c)\n");
+    fprintf(stderr, "    --residency       print which fraction of each file is in the page cache\n");
+    fprintf(stderr, "    --stats FORMAT    csv or json summary: MB/s, syscalls/MB, rusage, p50/p99 file latency\n");
+}
+
+/**
+ * Display the final summary, with the per thread throughput for the parallel engine
+ */
+static void print_summary(const t_copy_ctx *ctx, double elapsed)
+{
+    char        digest[32];
+    unsigned    i;
+
+    printf("[+] Copied all data (%llu bytes, %llu syscalls, engine: %s, block: %zu, %.1f MB/s",
+           ctx->bytes, ctx->syscalls, engine_get(ctx->used)->name, ctx->io.block,
+           ctx->bytes / (elapsed + 1e-9) / 1e6);
+    if (ctx->used == ENGINE_SPARSE)
+        printf(", holes: %llu bytes", ctx->skipped);
+    if (ctx->sum.id != CHECKSUM_NONE)
+        printf(", %s: %s%s", checksum_name(ctx->sum.id), checksum_format(&ctx->sum, digest),
+               ctx->verify ? " verified" : "");
+    if (ctx->used != ENGINE_PARALLEL)
     {
-        fprintf(stderr, "[-] An error occured while reading data\n");
-        perror("read");
-        close_files(infd, outfd);
-        return RETURN_ERROR;
+        printf(")\n");
+        return;
     }
-    return RETURN_SUCCESS;
+    printf(", threads: %u, chunk: %zu)\n", ctx->threads, ctx->chunk_size);
+    for (i = 0 ; i < ctx->threads ; ++i)
+        printf("Thread [%u] Copied: %llu bytes, %.1f MB/s\n", i, ctx->thread_stats[i].bytes,
+               ctx->thread_stats[i].bytes / (ctx->thread_stats[i].seconds + 1e-9) / 1e6);
+}
+
+/**
+ * Parse one option into ctx, returns RETURN_ERROR if its argument is invalid
+ */
+static int  parse_option(t_copy_ctx *ctx, int opt, const char *arg)
+{
+    int     i;
+
+    switch (opt)
+    {
+        case 'e':
+            if ((ctx->engine = engine_from_name(arg)) != ENGINE_COUNT)
+                return RETURN_SUCCESS;
+            fprintf(stderr, "[-] Unknown engine: %s\n", arg);
+            return RETURN_ERROR;
+        case 'm': case 'M':
+            ctx->engine = ENGINE_MMAP;
+            ctx->mmap_output = (opt == 'M');
+            return RETURN_SUCCESS;
+        case 'D': case 'F':
+            ctx->engine = (opt == 'D' ? ENGINE_DIRECT : ENGINE_FADVISE);
+            return RETURN_SUCCESS;
+        case 'k':
+            if ((ctx->sum.id = checksum_from_name(arg)) != CHECKSUM_COUNT)
+                return RETURN_SUCCESS;
+            fprintf(stderr, "[-] Unknown checksum: %s\n", arg);
+            return RETURN_ERROR;
+        case 'S':
+            if ((ctx->stats = stats_from_name(arg)) != STATS_COUNT)
+                return RETURN_SUCCESS;
+            fprintf(stderr, "[-] Unknown stats format: %s\n", arg);
+            return RETURN_ERROR;
+        case 'V':
+            ctx->verify = 1;
+            if (ctx->sum.id == CHECKSUM_NONE)
+                ctx->sum.id = CHECKSUM_CRC32C;
+            return RETURN_SUCCESS;
+        case 'z':
+            ctx->zero_detect = 1;
+            ctx->sparse = SPARSE_ALWAYS;
+            return RETURN_SUCCESS;
+        case 's':
+            for (i = 0 ; sparse_modes[i] != NULL ; ++i)
+                if (strcmp(sparse_modes[i], arg) == 0)
+                {
+                    ctx->sparse = i;
+                    return RETURN_SUCCESS;
+                }
+            fprintf(stderr, "[-] Invalid sparse mode: %s\n", arg);
+            return RETURN_ERROR;
+        case 'b': case 'c':
+            if ((opt == 'b' ? (ctx->block = iosize_parse(arg)) : (ctx->chunk_size = iosize_parse(arg))) != 0)
+                return RETURN_SUCCESS;
+            fprintf(stderr, "[-] Invalid block size: %s\n", arg);
+            return RETURN_ERROR;
+        case 'q': case 'n': case 'j':
+            if ((i = atoi(arg)) <= 0)
+            {
+                fprintf(stderr, "[-] Invalid count: %s\n", arg);
+                return RETURN_ERROR;
+            }
+            if (opt == 'q')
+                ctx->uring_depth = i;
+            else if (opt == 'n')
+                ctx->uring_buffers = i;
+            else
+                ctx->threads = i;
+            return RETURN_SUCCESS;
+    }
+    return RETURN_ERROR;
 }
 
 /**
@@ -95,28 +258,53 @@ int copy_files(int infd, int outfd)
  */
 int         main(int argc, char **argv)
 {
-    char    *infile, *outfile;
-    int     infd, outfd;
+    char        *infile, *outfile, *manifest = NULL;
+    t_copy_ctx  ctx = {.uring_depth = URING_DEPTH, .chunk_size = PARALLEL_CHUNK};
+    int         opt, ret, recursive = 0, residency = 0;
+    double      start;
 
-    if (argc < 3) 
+    ctx.threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    while ((opt = getopt_long(argc, argv, "e:b:j:zrf:k:", long_options, NULL)) != -1)
     {
-        fprintf(stderr, "[+] Usage: %s <input file> <output file>\n", argv[0]);
+        if (opt == 'r' || opt == 'f' || opt == 'R')
+        {
+            recursive |= (opt == 'r');
+            residency |= (opt == 'R');
+            manifest = (opt == 'f' ? optarg : manifest);
+            continue;
+        }
+        if (parse_option(&ctx, opt, optarg) == RETURN_SUCCESS)
+            continue;
+        usage(argv[0]);
         return RETURN_ERROR;
     }
-    // infile and outfile are easier to read
-    infile = argv[1];
-    outfile = argv[2];
-    if (open_files(infile, outfile, &infd, &outfd) == RETURN_ERROR)
-        return RETURN_ERROR;
-    if (copy_files(infd, outfd) == RETURN_ERROR)
+    for (ret = RETURN_SUCCESS ; residency && optind < argc ; ++optind)
+        ret |= print_residency(argv[optind]);
+    if (residency)
+        return ret;
+    if (manifest != NULL)
+        return tree_copy(&ctx, NULL, optind < argc ? argv[optind] : NULL, manifest);
+    if (argc - optind < 2) 
+    {
+        usage(argv[0]);
         return RETURN_ERROR;
-    printf("[+] Copied all data\n");
-    // closing file descriptors
-    close_files(infd, outfd);
-    return RETURN_SUCCESS;
+    }
+    // infile and outfile are easier to read
+    infile = argv[optind];
+    outfile = argv[optind + 1];
+    if (recursive)
+        return tree_copy(&ctx, infile, outfile, NULL);
+    start = clock_seconds();
+    if ((ret = copy_file(&ctx, infile, outfile)) == RETURN_SUCCESS && ctx.stats != STATS_NONE)
+        print_stats(&ctx, ctx.used, 1, clock_seconds() - start);
+    else if (ret == RETURN_SUCCESS)
+        print_summary(&ctx, clock_seconds() - start);
+    free(ctx.buffer);
+    free(ctx.thread_stats);
+    free(ctx.latencies);
+    return ret;
 }
 
-
 // [sakiir@Sakiir-PC Prog1]$ gcc filecpy.c -o filecpy
 // [sakiir@Sakiir-PC Prog1]$ ./filecpy 
 // [+] Usage: ./filecpy <input file> <output file>
@@ -0,0 +1,225 @@
+#ifndef FILECPY_H_
+# define FILECPY_H_
+
+# include <stddef.h>
+# include <stdint.h>
+# include <sys/types.h>
+
+# define RETURN_SUCCESS (0)
+# define RETURN_ERROR (1)
+# define ENGINE_UNSUPPORTED (2)
+# define SYSCALL_ERROR (-1)
+# define ENGINE_CHUNK (1 << 30)
+# define IOSIZE_DEFAULT (128 << 10)
+# define IOSIZE_MAX (8 << 20)
+# define IOSIZE_WINDOW (0.05)
+# define IOSIZE_GAIN (1.05)
+# define OUTFILE_PERMS (S_IRWXU | S_IRGRP | S_IROTH)
+# define OUTFILE_MODE (O_CREAT | O_WRONLY | O_TRUNC)
+# define OUTFILE_MODE_RW (O_CREAT | O_RDWR | O_TRUNC)
+# define MMAP_WINDOW (64 << 20)
+# define MMAP_STEP (2 << 20)
+# define MMAP_PREFETCH (4)
+# define URING_DEPTH (32)
+# define PARALLEL_CHUNK (64 << 20)
+# define TREE_BIG_FILE (64 << 20)
+# define TREE_IDLE_SLEEP (100000)
+# define DIRECT_ALIGN (4096)
+# define FADVISE_WINDOW (16 << 20)
+
+/**
+ * Copy engines, ENGINE_AUTO tries each zero-copy engine in order
+ * and falls back to the read()/write() loop. The engines declared after
+ * ENGINE_READWRITE are never picked automatically.
+ */
+typedef enum        e_engine_id
+{
+    ENGINE_AUTO = 0,
+    ENGINE_COPY_FILE_RANGE,
+    ENGINE_SENDFILE,
+    ENGINE_SPLICE,
+    ENGINE_READWRITE,
+    ENGINE_MMAP,
+    ENGINE_URING,
+    ENGINE_PARALLEL,
+    ENGINE_SPARSE,
+    ENGINE_DIRECT,
+    ENGINE_FADVISE,
+    ENGINE_COUNT
+}                   t_engine_id;
+
+/**
+ * Digests computed on the fly by the engines which see the data
+ */
+typedef enum        e_checksum_id
+{
+    CHECKSUM_NONE = 0,
+    CHECKSUM_CRC32C,
+    CHECKSUM_XXH64,
+    CHECKSUM_COUNT
+}                   t_checksum_id;
+
+typedef struct      s_checksum
+{
+    t_checksum_id   id;
+    uint32_t        crc;
+    uint64_t        acc[4];
+    unsigned char   stripe[32];
+    size_t          pending;
+    unsigned long long total;
+}                   t_checksum;
+
+/**
+ * Machine readable summary printed by --stats
+ */
+typedef enum        e_stats_format
+{
+    STATS_NONE = 0,
+    STATS_CSV,
+    STATS_JSON,
+    STATS_COUNT
+}                   t_stats_format;
+
+/**
+ * When to copy hole by hole with the sparse engine
+ */
+typedef enum        e_sparse
+{
+    SPARSE_AUTO = 0,
+    SPARSE_ALWAYS,
+    SPARSE_NEVER
+}                   t_sparse;
+
+/**
+ * Block size used by the engines going through a userspace buffer.
+ * `block` starts from st_blksize and, when `adaptive` is set, doubles
+ * as long as the measured throughput keeps improving (up to `max`).
+ */
+typedef struct      s_iosize
+{
+    size_t          block;
+    size_t          max;
+    int             adaptive;
+    double          window_start;
+    unsigned long long window_bytes;
+    double          best_rate;
+    size_t          best_block;
+}                   t_iosize;
+
+/**
+ * What one thread of the parallel engine did
+ */
+typedef struct      s_thread_stats
+{
+    unsigned long long bytes;
+    unsigned long long syscalls;
+    double          seconds;
+}                   t_thread_stats;
+
+/**
+ * State shared by every engine during one copy. The settings (engine,
+ * sparse, block and below) come from the command line, the counters
+ * add up over every file copied with the same context.
+ */
+typedef struct      s_copy_ctx
+{
+    t_engine_id     engine;
+    t_sparse        sparse;
+    size_t          block;
+    size_t          buffer_size;
+    int             infd;
+    int             outfd;
+    unsigned long long bytes;
+    unsigned long long syscalls;
+    unsigned long long ops;
+    t_engine_id     used;
+    t_iosize        io;
+    char            *buffer;
+    int             mmap_output;
+    unsigned        uring_depth;
+    unsigned        uring_buffers;
+    unsigned        threads;
+    size_t          chunk_size;
+    t_thread_stats  *thread_stats;
+    int             zero_detect;
+    unsigned long long skipped;
+    t_checksum      sum;
+    int             verify;
+    t_stats_format  stats;
+    double          *latencies;
+    size_t          latency_count;
+    size_t          latency_size;
+}                   t_copy_ctx;
+
+/**
+ * An engine copies from ctx->infd (current offset) to ctx->outfd until EOF.
+ * It returns ENGINE_UNSUPPORTED when the kernel or the file types don't
+ * allow it, so the caller can try the next one from the same offsets.
+ * When such an engine was forced, `fallback` is used instead (or the copy
+ * fails if it is ENGINE_AUTO). `inline_data` engines read the data in
+ * order through userspace and feed ctx->sum.
+ */
+typedef struct      s_engine
+{
+    const char      *name;
+    int             (*copy)(t_copy_ctx *ctx);
+    t_engine_id     fallback;
+    int             inline_data;
+}                   t_engine;
+
+/* filecpy.c */
+int                 copy_file(t_copy_ctx *ctx, const char *infile, const char *outfile);
+
+/* tree.c */
+int                 tree_copy(const t_copy_ctx *config, const char *input,
+                              const char *output, const char *manifest);
+
+/* engine.c */
+const t_engine      *engine_get(t_engine_id id);
+t_engine_id         engine_from_name(const char *name);
+int                 copy_files(t_copy_ctx *ctx, t_engine_id engine);
+int                 write_all(t_copy_ctx *ctx, int fd, const char *buffer, size_t len);
+int                 file_range(t_copy_ctx *ctx, off_t *in_off, off_t *out_off, off_t *end);
+
+/* mmap_copy.c */
+int                 mmap_engine(t_copy_ctx *ctx);
+
+/* uring.c */
+int                 uring_engine(t_copy_ctx *ctx);
+
+/* parallel.c */
+int                 parallel_engine(t_copy_ctx *ctx);
+
+/* sparse.c */
+int                 sparse_engine(t_copy_ctx *ctx);
+int                 is_sparse(int fd);
+
+/* direct.c */
+int                 direct_engine(t_copy_ctx *ctx);
+int                 fadvise_engine(t_copy_ctx *ctx);
+int                 print_residency(const char *path);
+
+/* checksum.c */
+const char          *checksum_name(t_checksum_id id);
+t_checksum_id       checksum_from_name(const char *name);
+void                checksum_init(t_checksum *sum, t_checksum_id id);
+void                checksum_update(t_checksum *sum, const void *data, size_t len);
+void                checksum_zeros(t_checksum *sum, size_t len);
+uint64_t            checksum_final(const t_checksum *sum);
+const char          *checksum_format(const t_checksum *sum, char *str);
+int                 verify_file(t_copy_ctx *ctx, const char *outfile);
+
+/* stats.c */
+t_stats_format      stats_from_name(const char *name);
+void                stats_record(t_copy_ctx *ctx, double seconds);
+void                stats_merge(t_copy_ctx *ctx, const t_copy_ctx *from);
+void                print_stats(t_copy_ctx *ctx, t_engine_id used, unsigned long long files, double elapsed);
+
+/* iosize.c */
+double              clock_seconds(void);
+size_t              iosize_parse(const char *str);
+int                 iosize_init(t_iosize *io, int infd, int outfd, size_t block);
+char                *iosize_alloc(const t_iosize *io);
+void                iosize_update(t_iosize *io, size_t bytes);
+
+#endif /* !FILECPY_H_ */
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filecpy.h"
+
+/**
+ * Monotonic clock in seconds
+ */
+double      clock_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Parse a size like "4096", "64K", "8M" or "1G", returns 0 if invalid
+ */
+size_t      iosize_parse(const char *str)
+{
+    char                *end;
+    unsigned long long  size = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+        case 'k': case 'K': size <<= 10; ++end; break;
+        case 'm': case 'M': size <<= 20; ++end; break;
+        case 'g': case 'G': size <<= 30; ++end; break;
+    }
+    if (*end != '\0' && strcmp(end, "iB") != 0 && strcmp(end, "B") != 0)
+        return 0;
+    return size;
+}
+
+/**
+ * Preferred I/O size of fd, never smaller than a page
+ */
+static size_t   preferred_block(int fd)
+{
+    struct stat st;
+    size_t      page = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fd, &st) == SYSCALL_ERROR || (size_t)st.st_blksize < page)
+        return page;
+    return st.st_blksize;
+}
+
+/**
+ * Pick the block size for infd -> outfd.
+ *
+ * st_blksize is only a minimum (it is 4 KiB on most filesystems, which
+ * leaves NVMe drives mostly idle), so start at the first multiple of it
+ * above IOSIZE_DEFAULT and let iosize_update() grow it. A non zero
+ * `block` is a user override and disables the adaptation.
+ */
+int         iosize_init(t_iosize *io, int infd, int outfd, size_t block)
+{
+    size_t  in = preferred_block(infd);
+    size_t  out = preferred_block(outfd);
+    size_t  base = in > out ? in : out;
+
+    memset(io, 0, sizeof(*io));
+    if (block != 0)
+    {
+        io->block = block;
+        io->max = block;
+        return RETURN_SUCCESS;
+    }
+    io->block = (IOSIZE_DEFAULT + base - 1) / base * base;
+    io->max = io->block > IOSIZE_MAX ? io->block : IOSIZE_MAX;
+    io->best_block = io->block;
+    io->adaptive = 1;
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Allocate a page aligned buffer big enough for the largest block
+ * the adaptation can reach
+ */
+char        *iosize_alloc(const t_iosize *io)
+{
+    void    *buffer;
+
+    if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), io->max) != 0)
+    {
+        fprintf(stderr, "[-] Failed to allocate a %zu bytes buffer\n", io->max);
+        return NULL;
+    }
+    return buffer;
+}
+
+/**
+ * Account `bytes` transferred with the current block size.
+ *
+ * Every IOSIZE_WINDOW seconds, compare the throughput with the best one:
+ * keep doubling the block while it improves by more than IOSIZE_GAIN,
+ * otherwise settle back on the best block size seen.
+ */
+void        iosize_update(t_iosize *io, size_t bytes)
+{
+    double  now, rate;
+
+    if (!io->adaptive)
+        return;
+    now = clock_seconds();
+    if (io->window_start == 0)
+    {
+        io->window_start = now;
+        return;
+    }
+    io->window_bytes += bytes;
+    if (now - io->window_start < IOSIZE_WINDOW)
+        return;
+    rate = io->window_bytes / (now - io->window_start);
+    io->window_start = now;
+    io->window_bytes = 0;
+    if (rate > io->best_rate * IOSIZE_GAIN)
+    {
+        io->best_rate = rate;
+        io->best_block = io->block;
+        if (io->block * 2 <= io->max)
+        {
+            io->block *= 2;
+            return;
+        }
+    }
+    io->block = io->best_block;
+    io->adaptive = 0;
+}
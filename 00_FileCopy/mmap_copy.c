@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "filecpy.h"
+
+/**
+ * One mapped window of a file, `data` points to the requested offset
+ * inside the page aligned mapping `base`
+ */
+typedef struct      s_window
+{
+    char            *base;
+    size_t          length;
+    char            *data;
+}                   t_window;
+
+/**
+ * Map `len` bytes of fd starting at `offset` (which does not have to be page aligned)
+ */
+static int  map_window(t_copy_ctx *ctx, t_window *win, int fd, int prot, off_t offset, size_t len)
+{
+    off_t   aligned = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+
+    ++ctx->syscalls;
+    win->length = len + (offset - aligned);
+    if ((win->base = mmap(NULL, win->length, prot, MAP_SHARED, fd, aligned)) == MAP_FAILED)
+    {
+        perror("mmap");
+        return RETURN_ERROR;
+    }
+    win->data = win->base + (offset - aligned);
+    return RETURN_SUCCESS;
+}
+
+static void unmap_window(t_copy_ctx *ctx, t_window *win)
+{
+    ++ctx->syscalls;
+    munmap(win->base, win->length);
+}
+
+/**
+ * madvise() the pages covering [ptr, ptr + len) of the window
+ */
+static void advise_window(t_copy_ctx *ctx, t_window *win, char *ptr, size_t len, int advice)
+{
+    char    *end = ptr + len;
+    char    *start = win->base + ((ptr - win->base) & ~(sysconf(_SC_PAGESIZE) - 1));
+
+    if (start < win->base)
+        start = win->base;
+    if (end > win->base + win->length)
+        end = win->base + win->length;
+    if (end <= start)
+        return;
+    ++ctx->syscalls;
+    madvise(start, end - start, advice);
+}
+
+/**
+ * Copy `len` bytes of the input window starting at `pos`, to the output
+ * (either through write() or a memcpy() into the output window)
+ */
+static int  copy_step(t_copy_ctx *ctx, t_window *in, t_window *out, size_t pos, size_t len)
+{
+    checksum_update(&ctx->sum, in->data + pos, len);
+    if (out == NULL)
+        return write_all(ctx, ctx->outfd, in->data + pos, len);
+    memcpy(out->data + pos, in->data + pos, len);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy one window of `len` bytes, MMAP_STEP bytes at a time: the kernel is
+ * asked to read MMAP_PREFETCH steps ahead of the cursor, and the pages
+ * behind it are dropped from our mappings so the resident set stays bounded.
+ */
+static int  copy_window(t_copy_ctx *ctx, off_t in_off, off_t out_off, size_t len)
+{
+    t_window    in, out;
+    size_t      pos, step;
+    int         ret = RETURN_SUCCESS;
+
+    if (map_window(ctx, &in, ctx->infd, PROT_READ, in_off, len) == RETURN_ERROR)
+        return RETURN_ERROR;
+    if (ctx->mmap_output
+        && map_window(ctx, &out, ctx->outfd, PROT_READ | PROT_WRITE, out_off, len) == RETURN_ERROR)
+    {
+        unmap_window(ctx, &in);
+        return RETURN_ERROR;
+    }
+    advise_window(ctx, &in, in.data, len, MADV_SEQUENTIAL);
+    advise_window(ctx, &in, in.data, MMAP_PREFETCH * MMAP_STEP, MADV_WILLNEED);
+    for (pos = 0 ; pos < len && ret == RETURN_SUCCESS ; pos += step)
+    {
+        step = len - pos < MMAP_STEP ? len - pos : MMAP_STEP;
+        advise_window(ctx, &in, in.data + pos + MMAP_PREFETCH * MMAP_STEP, step, MADV_WILLNEED);
+        ret = copy_step(ctx, &in, ctx->mmap_output ? &out : NULL, pos, step);
+        advise_window(ctx, &in, in.data + pos, step, MADV_DONTNEED);
+        if (ctx->mmap_output)
+            advise_window(ctx, &out, out.data + pos, step, MADV_DONTNEED);
+        ctx->bytes += step;
+    }
+    if (ctx->mmap_output)
+        unmap_window(ctx, &out);
+    unmap_window(ctx, &in);
+    return ret;
+}
+
+/**
+ * Copy the input through MMAP_WINDOW bytes mappings instead of read().
+ *
+ * The input is mapped window by window from its current offset, and the
+ * output is either written from the mapping or, with ctx->mmap_output,
+ * ftruncate()d to its final size and mapped as well.
+ */
+int         mmap_engine(t_copy_ctx *ctx)
+{
+    off_t       in_off, out_off, end;
+    size_t      len;
+
+    if (file_range(ctx, &in_off, &out_off, &end) == ENGINE_UNSUPPORTED)
+        return ENGINE_UNSUPPORTED;
+    if (ctx->mmap_output && in_off < end
+        && ftruncate(ctx->outfd, out_off + (end - in_off)) == SYSCALL_ERROR)
+    {
+        perror("ftruncate");
+        return RETURN_ERROR;
+    }
+    while (in_off < end)
+    {
+        len = end - in_off < MMAP_WINDOW ? end - in_off : MMAP_WINDOW;
+        if (copy_window(ctx, in_off, out_off, len) == RETURN_ERROR)
+            return RETURN_ERROR;
+        in_off += len;
+        out_off += len;
+    }
+    /* Leave both offsets where a read()/write() copy would have */
+    lseek(ctx->infd, in_off, SEEK_SET);
+    lseek(ctx->outfd, out_off, SEEK_SET);
+    return RETURN_SUCCESS;
+}
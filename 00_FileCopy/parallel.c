@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "filecpy.h"
+
+/**
+ * Shared state of one parallel copy, `next` is the next input offset to
+ * hand out and is only touched with atomic fetch-add
+ */
+typedef struct      s_parallel
+{
+    t_copy_ctx      *ctx;
+    off_t           next;
+    off_t           end;
+    off_t           delta;
+    int             failed;
+}                   t_parallel;
+
+typedef struct      s_worker
+{
+    pthread_t       thread_id;
+    t_parallel      *parallel;
+    t_thread_stats  *stats;
+}                   t_worker;
+
+/**
+ * Copy [offset, offset + len) of the input at offset + delta in the output
+ */
+static int  copy_range(t_parallel *parallel, t_thread_stats *stats, char *buffer, off_t offset, size_t len)
+{
+    t_copy_ctx  *ctx = parallel->ctx;
+    ssize_t     n, w;
+    size_t      done;
+
+    while (len > 0)
+    {
+        ++stats->syscalls;
+        if ((n = pread(ctx->infd, buffer, len < ctx->io.block ? len : ctx->io.block, offset)) <= 0)
+        {
+            if (n == SYSCALL_ERROR && errno == EINTR)
+                continue;
+            fprintf(stderr, "[-] pread() failed at offset %lld\n", (long long)offset);
+            return RETURN_ERROR;
+        }
+        for (done = 0 ; done < (size_t)n ; done += w)
+        {
+            ++stats->syscalls;
+            if ((w = pwrite(ctx->outfd, buffer + done, n - done, offset + parallel->delta + done)) == SYSCALL_ERROR)
+            {
+                if (errno == EINTR)
+                {
+                    w = 0;
+                    continue;
+                }
+                perror("pwrite");
+                return RETURN_ERROR;
+            }
+        }
+        stats->bytes += n;
+        offset += n;
+        len -= n;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Worker thread: claim the next chunk until the whole range is handed out
+ */
+static void *parallel_worker(void *arg)
+{
+    t_worker    *worker = (t_worker *)arg;
+    t_parallel  *parallel = worker->parallel;
+    size_t      chunk = parallel->ctx->chunk_size;
+    double      start = clock_seconds();
+    char        *buffer;
+    off_t       offset;
+
+    if ((buffer = iosize_alloc(&parallel->ctx->io)) == NULL)
+    {
+        __atomic_store_n(&parallel->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    while (!__atomic_load_n(&parallel->failed, __ATOMIC_RELAXED)
+           && (offset = __atomic_fetch_add(&parallel->next, chunk, __ATOMIC_RELAXED)) < parallel->end)
+    {
+        if (copy_range(parallel, worker->stats, buffer,
+                       offset, parallel->end - offset < (off_t)chunk ? (size_t)(parallel->end - offset) : chunk) == RETURN_ERROR)
+            __atomic_store_n(&parallel->failed, 1, __ATOMIC_RELAXED);
+    }
+    worker->stats->seconds = clock_seconds() - start;
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Reserve the whole output at once so the threads don't race on extending
+ * the file (and the filesystem can allocate it contiguously)
+ */
+static int  preallocate(t_copy_ctx *ctx, off_t offset, off_t len)
+{
+    ++ctx->syscalls;
+    if (len == 0 || fallocate(ctx->outfd, 0, offset, len) == 0)
+        return RETURN_SUCCESS;
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        perror("fallocate");
+        return RETURN_ERROR;
+    }
+    ++ctx->syscalls;
+    if (ftruncate(ctx->outfd, offset + len) == SYSCALL_ERROR)
+    {
+        perror("ftruncate");
+        return RETURN_ERROR;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Split the input in ctx->chunk_size ranges copied by ctx->threads threads
+ * with pread()/pwrite(). Ranges are handed out dynamically, so a slow
+ * stripe doesn't hold back the others. The per thread statistics are
+ * left in ctx->thread_stats for the final summary.
+ */
+int         parallel_engine(t_copy_ctx *ctx)
+{
+    t_parallel  parallel = {ctx, 0, 0, 0, 0};
+    t_worker    *workers;
+    off_t       out_off;
+    unsigned    i, started;
+
+    if (file_range(ctx, &parallel.next, &out_off, &parallel.end) == ENGINE_UNSUPPORTED)
+        return ENGINE_UNSUPPORTED;
+    parallel.delta = out_off - parallel.next;
+    if (preallocate(ctx, out_off, parallel.end - parallel.next) == RETURN_ERROR)
+        return RETURN_ERROR;
+    workers = calloc(ctx->threads, sizeof(*workers));
+    free(ctx->thread_stats);
+    ctx->thread_stats = calloc(ctx->threads, sizeof(*ctx->thread_stats));
+    if (workers == NULL || ctx->thread_stats == NULL)
+    {
+        fprintf(stderr, "[-] Failed to allocate %u workers\n", ctx->threads);
+        free(workers);
+        return RETURN_ERROR;
+    }
+    for (started = 0 ; started < ctx->threads ; ++started)
+    {
+        workers[started].parallel = &parallel;
+        workers[started].stats = &ctx->thread_stats[started];
+        if (pthread_create(&workers[started].thread_id, NULL, parallel_worker, &workers[started]) != RETURN_SUCCESS)
+        {
+            fprintf(stderr, "[-] Failed to start thread %u\n", started);
+            break;
+        }
+    }
+    for (i = 0 ; i < started ; ++i)
+    {
+        pthread_join(workers[i].thread_id, NULL);
+        ctx->bytes += ctx->thread_stats[i].bytes;
+        ctx->syscalls += ctx->thread_stats[i].syscalls;
+    }
+    free(workers);
+    if (started == 0 || parallel.failed)
+        return RETURN_ERROR;
+    ctx->threads = started;
+    lseek(ctx->infd, parallel.end, SEEK_SET);
+    lseek(ctx->outfd, parallel.end + parallel.delta, SEEK_SET);
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filecpy.h"
+
+/**
+ * 32 bytes vector, the compiler turns the OR reduction below into
+ * AVX-512/AVX2/SSE2 instructions, the best one being picked at load time
+ */
+typedef uint64_t    t_vec __attribute__((vector_size(32)));
+
+/**
+ * Returns 1 if the `len` bytes of buffer (32 bytes aligned) are all zero
+ */
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static int  is_zero(const char *buffer, size_t len)
+{
+    const t_vec *vec = (const t_vec *)buffer;
+    t_vec       acc = {0, 0, 0, 0};
+    size_t      i, count = len / sizeof(t_vec);
+
+    for (i = 0 ; i < count ; ++i)
+        acc |= vec[i];
+    for (i = count * sizeof(t_vec) ; i < len ; ++i)
+        acc[0] |= (unsigned char)buffer[i];
+    return (acc[0] | acc[1] | acc[2] | acc[3]) == 0;
+}
+
+/**
+ * Returns 1 if the regular file fd allocates less blocks than its size,
+ * so copying it hole by hole is worth it
+ */
+int         is_sparse(int fd)
+{
+    struct stat st;
+
+    return (fstat(fd, &st) != SYSCALL_ERROR && S_ISREG(st.st_mode)
+            && (off_t)st.st_blocks * 512 < st.st_size);
+}
+
+/**
+ * A zero range is left as a hole in the output. The output is truncated
+ * when opened so skipping it is enough, unless it falls below the original
+ * output size where the old data has to be punched out.
+ */
+static int  skip_zeros(t_copy_ctx *ctx, off_t offset, size_t len, off_t out_size)
+{
+    ctx->skipped += len;
+    if (len == 0 || offset >= out_size)
+        return RETURN_SUCCESS;
+    ++ctx->syscalls;
+    if (fallocate(ctx->outfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == SYSCALL_ERROR)
+    {
+        perror("fallocate");
+        return RETURN_ERROR;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Write the whole `len` bytes of buffer at `offset`, pwrite() may be partial
+ */
+static int  pwrite_all(t_copy_ctx *ctx, const char *buffer, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        ++ctx->syscalls;
+        if ((n = pwrite(ctx->outfd, buffer, len, offset)) == SYSCALL_ERROR)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("pwrite");
+            return RETURN_ERROR;
+        }
+        buffer += n;
+        len -= n;
+        offset += n;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Write `len` bytes of buffer at `offset`, with ctx->zero_detect the runs
+ * of all zero `granule` blocks are skipped instead
+ */
+static int  write_data(t_copy_ctx *ctx, const char *buffer, size_t len, off_t offset,
+                       size_t granule, off_t out_size)
+{
+    size_t  pos = 0, run, step;
+    int     zero;
+
+    while (pos < len)
+    {
+        zero = ctx->zero_detect && is_zero(buffer + pos, len - pos < granule ? len - pos : granule);
+        for (run = 0 ; pos + run < len ; run += step)
+        {
+            step = len - pos - run < granule ? len - pos - run : granule;
+            if (run > 0 && ctx->zero_detect && is_zero(buffer + pos + run, step) != zero)
+                break;
+        }
+        if (zero && skip_zeros(ctx, offset + pos, run, out_size) == RETURN_ERROR)
+            return RETURN_ERROR;
+        if (!zero && pwrite_all(ctx, buffer + pos, run, offset + pos) == RETURN_ERROR)
+            return RETURN_ERROR;
+        pos += run;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy the data extent [start, end) of the input at start + delta
+ */
+static int  copy_extent(t_copy_ctx *ctx, off_t start, off_t end, off_t delta,
+                        size_t granule, off_t out_size)
+{
+    ssize_t n;
+
+    while (start < end)
+    {
+        ++ctx->syscalls;
+        if ((n = pread(ctx->infd, ctx->buffer,
+                       end - start < (off_t)ctx->io.block ? (size_t)(end - start) : ctx->io.block, start)) <= 0)
+        {
+            if (n == SYSCALL_ERROR && errno == EINTR)
+                continue;
+            fprintf(stderr, "[-] pread() failed at offset %lld\n", (long long)start);
+            return RETURN_ERROR;
+        }
+        checksum_update(&ctx->sum, ctx->buffer, n);
+        if (write_data(ctx, ctx->buffer, n, start + delta, granule, out_size) == RETURN_ERROR)
+            return RETURN_ERROR;
+        ctx->bytes += n;
+        start += n;
+        iosize_update(&ctx->io, n);
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy only the data extents of the input, found with SEEK_DATA/SEEK_HOLE,
+ * and leave the holes as holes in the output. With ctx->zero_detect the
+ * data extents are also scanned for zero filled blocks, so a preallocated
+ * or fully written but mostly empty image comes out sparse too.
+ * Filesystems without SEEK_DATA support report the whole file as data.
+ */
+int         sparse_engine(t_copy_ctx *ctx)
+{
+    struct stat st;
+    off_t       in_off, out_off, end, data, hole, delta;
+
+    if (file_range(ctx, &in_off, &out_off, &end) == ENGINE_UNSUPPORTED
+        || fstat(ctx->outfd, &st) == SYSCALL_ERROR)
+        return ENGINE_UNSUPPORTED;
+    delta = out_off - in_off;
+    for (; in_off < end ; in_off = hole)
+    {
+        ++ctx->syscalls;
+        if ((data = lseek(ctx->infd, in_off, SEEK_DATA)) == SYSCALL_ERROR)
+        {
+            if (errno != ENXIO)
+            {
+                perror("lseek");
+                return RETURN_ERROR;
+            }
+            data = end; /* Only a hole is left */
+        }
+        if (data > end)
+            data = end;
+        ++ctx->syscalls;
+        if (data == end || (hole = lseek(ctx->infd, data, SEEK_HOLE)) == SYSCALL_ERROR || hole > end)
+            hole = end;
+        checksum_zeros(&ctx->sum, data - in_off);
+        if (skip_zeros(ctx, in_off + delta, data - in_off, st.st_size) == RETURN_ERROR
+            || copy_extent(ctx, data, hole, delta, st.st_blksize, st.st_size) == RETURN_ERROR)
+            return RETURN_ERROR;
+        ctx->bytes += data - in_off;
+    }
+    /* The trailing hole only exists once the output has its final size */
+    ++ctx->syscalls;
+    if (ftruncate(ctx->outfd, end + delta) == SYSCALL_ERROR)
+    {
+        perror("ftruncate");
+        return RETURN_ERROR;
+    }
+    lseek(ctx->infd, end, SEEK_SET);
+    lseek(ctx->outfd, end + delta, SEEK_SET);
+    return RETURN_SUCCESS;
+}
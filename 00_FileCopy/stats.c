@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "filecpy.h"
+
+static const char   *stats_names[STATS_COUNT] = {"none", "csv", "json"};
+
+/**
+ * Returns the stats format matching `name`, or STATS_COUNT if there is none
+ */
+t_stats_format      stats_from_name(const char *name)
+{
+    t_stats_format  format;
+
+    for (format = STATS_NONE ; format < STATS_COUNT ; ++format)
+        if (strcmp(stats_names[format], name) == 0)
+            break;
+    return format;
+}
+
+/**
+ * Keep the duration of one file copy for the latency percentiles
+ */
+void                stats_record(t_copy_ctx *ctx, double seconds)
+{
+    double          *latencies;
+
+    if (ctx->latency_count == ctx->latency_size)
+    {
+        if ((latencies = realloc(ctx->latencies, (ctx->latency_size * 2 + 64) * sizeof(*latencies))) == NULL)
+            return;
+        ctx->latencies = latencies;
+        ctx->latency_size = ctx->latency_size * 2 + 64;
+    }
+    ctx->latencies[ctx->latency_count++] = seconds;
+}
+
+/**
+ * Add the latencies recorded by `from` (a tree worker) to ctx
+ */
+void                stats_merge(t_copy_ctx *ctx, const t_copy_ctx *from)
+{
+    size_t          i;
+
+    for (i = 0 ; i < from->latency_count ; ++i)
+        stats_record(ctx, from->latencies[i]);
+}
+
+static int          compare_double(const void *a, const void *b)
+{
+    double          x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Nearest-rank percentile of the sorted latencies, in milliseconds
+ */
+static double       percentile(const t_copy_ctx *ctx, double p)
+{
+    size_t          rank = (size_t)(p * ctx->latency_count + 0.999999);
+
+    if (ctx->latency_count == 0)
+        return 0.0;
+    return ctx->latencies[rank > 0 ? rank - 1 : 0] * 1e3;
+}
+
+/**
+ * Print one machine readable record for the whole run: throughput,
+ * syscalls per MB, CPU time and context switches from getrusage(), and the
+ * per file latency percentiles (which matter for the small files). The
+ * CSV format prints its header line first. `used` is the engine which
+ * really copied a single file.
+ */
+void                print_stats(t_copy_ctx *ctx, t_engine_id used, unsigned long long files, double elapsed)
+{
+    struct rusage   usage;
+    double          user, sys, p50, p99, mb = ctx->bytes / 1e6;
+
+    getrusage(RUSAGE_SELF, &usage);
+    user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    qsort(ctx->latencies, ctx->latency_count, sizeof(*ctx->latencies), compare_double);
+    p50 = percentile(ctx, 0.50);
+    p99 = percentile(ctx, 0.99);
+    if (ctx->stats == STATS_CSV)
+    {
+        printf("engine,used,block,files,bytes,seconds,mb_per_s,syscalls,syscalls_per_mb,"
+               "user_seconds,system_seconds,max_rss_kb,voluntary_switches,involuntary_switches,p50_ms,p99_ms\n");
+        printf("%s,%s,%zu,%llu,%llu,%.6f,%.1f,%llu,%.2f,%.6f,%.6f,%ld,%ld,%ld,%.4f,%.4f\n",
+               engine_get(ctx->engine)->name, engine_get(used)->name, ctx->io.block, files, ctx->bytes, elapsed,
+               mb / (elapsed + 1e-9), ctx->syscalls, ctx->syscalls / (mb + 1e-9), user, sys, usage.ru_maxrss,
+               usage.ru_nvcsw, usage.ru_nivcsw, p50, p99);
+        return;
+    }
+    printf("{\"engine\": \"%s\", \"used\": \"%s\", \"block\": %zu, \"files\": %llu, \"bytes\": %llu, \"seconds\": %.6f, "
+           "\"mb_per_s\": %.1f, \"syscalls\": %llu, \"syscalls_per_mb\": %.2f, \"user_seconds\": %.6f, "
+           "\"system_seconds\": %.6f, \"max_rss_kb\": %ld, \"voluntary_switches\": %ld, "
+           "\"involuntary_switches\": %ld, \"p50_ms\": %.4f, \"p99_ms\": %.4f}\n",
+           engine_get(ctx->engine)->name, engine_get(used)->name, ctx->io.block, files, ctx->bytes, elapsed,
+           mb / (elapsed + 1e-9), ctx->syscalls, ctx->syscalls / (mb + 1e-9), user, sys, usage.ru_maxrss,
+           usage.ru_nvcsw, usage.ru_nivcsw, p50, p99);
+}
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filecpy.h"
+
+/**
+ * A directory to walk, a file to copy, or a node to recreate (symlink,
+ * FIFO, device or socket: their contents are never read)
+ */
+typedef enum        e_task_type
+{
+    TASK_DIR = 0,
+    TASK_FILE,
+    TASK_LINK,
+    TASK_SPECIAL
+}                   t_task_type;
+
+typedef struct      s_task
+{
+    t_task_type     type;
+    char            *input;
+    char            *output;
+    struct s_task   *next;
+}                   t_task;
+
+/**
+ * Work-stealing deque: the owner pushes and pops at the tail (depth first,
+ * cache friendly), idle workers steal the oldest tasks from the head
+ * (usually whole directories, so one steal brings a lot of work)
+ */
+typedef struct      s_deque
+{
+    pthread_mutex_t lock;
+    t_task          **tasks;
+    size_t          head;
+    size_t          tail;
+    size_t          size;
+}                   t_deque;
+
+typedef struct      s_tree_worker
+{
+    pthread_t       thread_id;
+    struct s_tree   *tree;
+    unsigned        index;
+    t_deque         deque;
+    t_copy_ctx      ctx;
+    t_engine_id     used;
+    unsigned long long files;
+    unsigned long long stolen;
+}                   t_tree_worker;
+
+/**
+ * Shared state of a tree copy. `pending` counts the tasks queued or
+ * running, the copy is over when it drops to 0. Files bigger than
+ * TREE_BIG_FILE go to the `big` list, streamed by the main thread with
+ * the engine from the command line, while the workers keep going with
+ * the small ones.
+ */
+typedef struct      s_tree
+{
+    t_tree_worker   *workers;
+    unsigned        count;
+    unsigned long   pending;
+    pthread_mutex_t big_lock;
+    t_task          *big;
+    unsigned long long dirs;
+    unsigned long long failed;
+}                   t_tree;
+
+static void deque_push(t_deque *deque, t_task *task)
+{
+    t_task  **tasks;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->size && deque->head > 0)
+    {
+        memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(*tasks));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail == deque->size)
+    {
+        if ((tasks = realloc(deque->tasks, (deque->size * 2 + 16) * sizeof(*tasks))) == NULL)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            fprintf(stderr, "[-] Failed to queue %s\n", task->input);
+            return;
+        }
+        deque->tasks = tasks;
+        deque->size = deque->size * 2 + 16;
+    }
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * Take a task from the tail (`steal` == 0) or from the head of the deque
+ */
+static t_task   *deque_take(t_deque *deque, int steal)
+{
+    t_task  *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        task = (steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail]);
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static t_task   *task_new(t_task_type type, const char *input, const char *output)
+{
+    t_task  *task;
+
+    if ((task = calloc(1, sizeof(*task))) == NULL
+        || (task->input = strdup(input)) == NULL || (task->output = strdup(output)) == NULL)
+    {
+        fprintf(stderr, "[-] Failed to allocate a task for %s\n", input);
+        if (task != NULL)
+            free(task->input);
+        free(task);
+        return NULL;
+    }
+    task->type = type;
+    return task;
+}
+
+static void task_free(t_task *task)
+{
+    free(task->input);
+    free(task->output);
+    free(task);
+}
+
+/**
+ * Queue a new task on `worker`
+ */
+static void schedule(t_tree_worker *worker, t_task_type type, const char *input, const char *output)
+{
+    t_task  *task;
+
+    if ((task = task_new(type, input, output)) == NULL)
+    {
+        __atomic_add_fetch(&worker->tree->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&worker->tree->pending, 1, __ATOMIC_RELAXED);
+    deque_push(&worker->deque, task);
+}
+
+/**
+ * Create the output directory and queue a task for each entry
+ */
+static int  walk_dir(t_tree_worker *worker, t_task *task)
+{
+    char            input[PATH_MAX], output[PATH_MAX];
+    struct dirent   *entry;
+    struct stat     st;
+    DIR             *dir;
+
+    if (stat(task->input, &st) == SYSCALL_ERROR
+        || (mkdir(task->output, st.st_mode & 07777) == SYSCALL_ERROR && errno != EEXIST)
+        || (dir = opendir(task->input)) == NULL)
+    {
+        fprintf(stderr, "[-] Failed to copy directory %s: %s\n", task->input, strerror(errno));
+        return RETURN_ERROR;
+    }
+    __atomic_add_fetch(&worker->tree->dirs, 1, __ATOMIC_RELAXED);
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        if (snprintf(input, sizeof(input), "%s/%s", task->input, entry->d_name) >= (int)sizeof(input)
+            || snprintf(output, sizeof(output), "%s/%s", task->output, entry->d_name) >= (int)sizeof(output))
+        {
+            fprintf(stderr, "[-] Path too long: %s/%s\n", task->input, entry->d_name);
+            __atomic_add_fetch(&worker->tree->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (entry->d_type == DT_DIR)
+            schedule(worker, TASK_DIR, input, output);
+        else if (entry->d_type == DT_LNK)
+            schedule(worker, TASK_LINK, input, output);
+        else if (entry->d_type == DT_FIFO || entry->d_type == DT_CHR
+                 || entry->d_type == DT_BLK || entry->d_type == DT_SOCK)
+            schedule(worker, TASK_SPECIAL, input, output);
+        else
+            schedule(worker, TASK_FILE, input, output);
+    }
+    closedir(dir);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Recreate a symbolic link
+ */
+static int  copy_link(t_task *task)
+{
+    char    target[PATH_MAX];
+    ssize_t len;
+
+    if ((len = readlink(task->input, target, sizeof(target) - 1)) == SYSCALL_ERROR)
+    {
+        perror("readlink");
+        return RETURN_ERROR;
+    }
+    target[len] = '\0';
+    unlink(task->output);
+    if (symlink(target, task->output) == SYSCALL_ERROR)
+    {
+        perror("symlink");
+        return RETURN_ERROR;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Recreate a FIFO, device node or socket. Opening a FIFO would block until
+ * a writer shows up and a device would be streamed, so they are made with
+ * mknod(); devices need privileges, they are skipped with a warning then.
+ */
+static int  copy_special(t_task *task)
+{
+    struct stat st;
+
+    if (lstat(task->input, &st) == SYSCALL_ERROR)
+    {
+        perror("lstat");
+        return RETURN_ERROR;
+    }
+    unlink(task->output);
+    if (mknod(task->output, st.st_mode, st.st_rdev) == SYSCALL_ERROR)
+    {
+        if (errno != EPERM)
+        {
+            perror("mknod");
+            return RETURN_ERROR;
+        }
+        fprintf(stderr, "[~] Skipping special file %s: %s\n", task->input, strerror(errno));
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Count a copied file and the engine which copied it (ENGINE_AUTO once
+ * they differ, ENGINE_COUNT until the first one), and print its digest
+ * like sha256sum does
+ */
+static void print_digest(const t_copy_ctx *ctx, const t_task *task, unsigned long long *files, t_engine_id *used)
+{
+    char    digest[32];
+
+    ++*files;
+    *used = (*used == ENGINE_COUNT || *used == ctx->used ? ctx->used : ENGINE_AUTO);
+    if (ctx->sum.id != CHECKSUM_NONE)
+        printf("%s  %s\n", checksum_format(&ctx->sum, digest), task->output);
+}
+
+/**
+ * Run one task, big files are handed over to the streaming list.
+ * Returns 1 if the task is done (and can be freed).
+ */
+static int  run_task(t_tree_worker *worker, t_task *task)
+{
+    t_tree      *tree = worker->tree;
+    struct stat st;
+    int         ret;
+
+    /* d_type is DT_UNKNOWN on some filesystems, check what files really are */
+    if (task->type == TASK_FILE && lstat(task->input, &st) == 0)
+        task->type = (S_ISDIR(st.st_mode) ? TASK_DIR : S_ISLNK(st.st_mode) ? TASK_LINK
+                      : S_ISREG(st.st_mode) ? TASK_FILE : TASK_SPECIAL);
+    else if (task->type == TASK_FILE)
+        st.st_size = 0; /* copy_file() reports the error */
+    if (task->type == TASK_DIR)
+        ret = walk_dir(worker, task);
+    else if (task->type == TASK_LINK)
+        ret = copy_link(task);
+    else if (task->type == TASK_SPECIAL)
+        ret = copy_special(task);
+    else if (st.st_size >= TREE_BIG_FILE)
+    {
+        pthread_mutex_lock(&tree->big_lock);
+        task->next = tree->big;
+        tree->big = task;
+        pthread_mutex_unlock(&tree->big_lock);
+        return 0;
+    }
+    else if ((ret = copy_file(&worker->ctx, task->input, task->output)) == RETURN_SUCCESS)
+        print_digest(&worker->ctx, task, &worker->files, &worker->used);
+    if (ret != RETURN_SUCCESS)
+        __atomic_add_fetch(&tree->failed, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * Pop local work first, then try to steal from the other workers
+ */
+static t_task   *find_task(t_tree_worker *worker)
+{
+    t_tree      *tree = worker->tree;
+    t_task      *task;
+    unsigned    i;
+
+    if ((task = deque_take(&worker->deque, 0)) != NULL)
+        return task;
+    for (i = 1 ; i < tree->count ; ++i)
+        if ((task = deque_take(&tree->workers[(worker->index + i) % tree->count].deque, 1)) != NULL)
+        {
+            ++worker->stolen;
+            return task;
+        }
+    return NULL;
+}
+
+static void *tree_worker(void *arg)
+{
+    t_tree_worker           *worker = (t_tree_worker *)arg;
+    t_task                  *task;
+    const struct timespec   idle = {0, TREE_IDLE_SLEEP};
+
+    while (__atomic_load_n(&worker->tree->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        if ((task = find_task(worker)) == NULL)
+        {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        if (run_task(worker, task))
+        {
+            task_free(task);
+            __atomic_sub_fetch(&worker->tree->pending, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Main thread side: stream the big files until every task is done
+ */
+static void stream_big_files(t_tree *tree, t_copy_ctx *ctx, unsigned long long *files, t_engine_id *used)
+{
+    const struct timespec   idle = {0, TREE_IDLE_SLEEP};
+    t_task                  *task;
+
+    while (__atomic_load_n(&tree->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        pthread_mutex_lock(&tree->big_lock);
+        if ((task = tree->big) != NULL)
+            tree->big = task->next;
+        pthread_mutex_unlock(&tree->big_lock);
+        if (task == NULL)
+        {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        if (copy_file(ctx, task->input, task->output) == RETURN_SUCCESS)
+            print_digest(ctx, task, files, used);
+        else
+            __atomic_add_fetch(&tree->failed, 1, __ATOMIC_RELAXED);
+        task_free(task);
+        __atomic_sub_fetch(&tree->pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Queue the manifest entries round robin on the workers. Each line is
+ * "<input>\t<output>", or just "<input>" copied into `output` directory.
+ */
+static int  read_manifest(t_tree *tree, const char *manifest, const char *output)
+{
+    char        *line = NULL, *tab, path[PATH_MAX];
+    size_t      size = 0;
+    ssize_t     len;
+    unsigned    next = 0;
+    FILE        *file;
+
+    if ((file = fopen(manifest, "r")) == NULL)
+    {
+        fprintf(stderr, "[-] Failed to open manifest: %s\n", manifest);
+        perror("fopen");
+        return RETURN_ERROR;
+    }
+    while ((len = getline(&line, &size, file)) != -1)
+    {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        if ((tab = strchr(line, '\t')) != NULL)
+            *tab++ = '\0';
+        else if (output == NULL
+                 || snprintf(path, sizeof(path), "%s/%s", output, basename(line)) >= (int)sizeof(path))
+        {
+            fprintf(stderr, "[-] No output for manifest entry: %s\n", line);
+            ++tree->failed;
+            continue;
+        }
+        schedule(&tree->workers[next++ % tree->count], TASK_FILE, line, tab != NULL ? tab : path);
+    }
+    free(line);
+    fclose(file);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy the `input` directory tree to `output`, or the files listed in
+ * `manifest`, with config->threads workers balancing the small files by
+ * work stealing and the main thread streaming the big ones.
+ */
+int         tree_copy(const t_copy_ctx *config, const char *input, const char *output, const char *manifest)
+{
+    t_tree              tree = {0};
+    t_copy_ctx          ctx = *config;
+    unsigned long long  files = 0, bytes = 0, stolen = 0;
+    t_engine_id         used = ENGINE_COUNT;
+    double              start = clock_seconds();
+    unsigned            i, started;
+
+    tree.count = config->threads;
+    if ((tree.workers = calloc(tree.count, sizeof(*tree.workers))) == NULL)
+    {
+        fprintf(stderr, "[-] Failed to allocate %u workers\n", tree.count);
+        return RETURN_ERROR;
+    }
+    pthread_mutex_init(&tree.big_lock, NULL);
+    for (i = 0 ; i < tree.count ; ++i)
+    {
+        tree.workers[i].tree = &tree;
+        tree.workers[i].index = i;
+        tree.workers[i].ctx = *config;
+        tree.workers[i].used = ENGINE_COUNT;
+        /* Splitting a small file across threads only costs thread creations */
+        if (config->engine == ENGINE_PARALLEL)
+            tree.workers[i].ctx.engine = ENGINE_AUTO;
+        pthread_mutex_init(&tree.workers[i].deque.lock, NULL);
+    }
+    if (manifest != NULL)
+        read_manifest(&tree, manifest, output);
+    else
+        schedule(&tree.workers[0], TASK_DIR, input, output);
+    for (started = 0 ; started < tree.count ; ++started)
+        if (pthread_create(&tree.workers[started].thread_id, NULL, tree_worker, &tree.workers[started]) != 0)
+        {
+            fprintf(stderr, "[-] Failed to start thread %u\n", started);
+            break;
+        }
+    if (started > 0)
+        stream_big_files(&tree, &ctx, &files, &used);
+    else
+        ++tree.failed;
+    for (i = 0 ; i < tree.count ; ++i)
+    {
+        if (i < started)
+            pthread_join(tree.workers[i].thread_id, NULL);
+        files += tree.workers[i].files;
+        bytes += tree.workers[i].ctx.bytes;
+        ctx.syscalls += tree.workers[i].ctx.syscalls;
+        stolen += tree.workers[i].stolen;
+        /* --stats reports what the files were really copied with, and the biggest block */
+        if (tree.workers[i].used != ENGINE_COUNT)
+        {
+            used = (used == ENGINE_COUNT || used == tree.workers[i].used ? tree.workers[i].used : ENGINE_AUTO);
+            if (tree.workers[i].ctx.io.block > ctx.io.block)
+                ctx.io.block = tree.workers[i].ctx.io.block;
+        }
+        stats_merge(&ctx, &tree.workers[i].ctx);
+        while (tree.workers[i].deque.tail > tree.workers[i].deque.head)
+            task_free(tree.workers[i].deque.tasks[--tree.workers[i].deque.tail]);
+        free(tree.workers[i].ctx.buffer);
+        free(tree.workers[i].ctx.thread_stats);
+        free(tree.workers[i].ctx.latencies);
+        free(tree.workers[i].deque.tasks);
+        pthread_mutex_destroy(&tree.workers[i].deque.lock);
+    }
+    ctx.bytes += bytes;
+    if (ctx.stats != STATS_NONE)
+        print_stats(&ctx, used == ENGINE_COUNT ? ENGINE_AUTO : used, files, clock_seconds() - start);
+    else
+        printf("[+] Copied all data (%llu files, %llu directories, %llu bytes, %llu syscalls, %.1f MB/s, workers: %u, steals: %llu)\n",
+               files, tree.dirs, ctx.bytes, ctx.syscalls, ctx.bytes / (clock_seconds() - start + 1e-9) / 1e6,
+               started, stolen);
+    if (tree.failed > 0)
+        fprintf(stderr, "[-] %llu entries failed\n", tree.failed);
+    pthread_mutex_destroy(&tree.big_lock);
+    free(tree.workers);
+    free(ctx.buffer);
+    free(ctx.thread_stats);
+    free(ctx.latencies);
+    return tree.failed > 0 ? RETURN_ERROR : RETURN_SUCCESS;
+}
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "filecpy.h"
+
+/**
+ * Mapped submission and completion rings (we talk to the kernel directly
+ * through the io_uring_* syscalls, liburing is not required)
+ */
+typedef struct              s_uring
+{
+    int                     fd;
+    void                    *sq_ring;
+    size_t                  sq_ring_size;
+    void                    *cq_ring;
+    size_t                  cq_ring_size;
+    unsigned                *sq_tail;
+    unsigned                *sq_mask;
+    unsigned                *sq_array;
+    struct io_uring_sqe     *sqes;
+    size_t                  sqes_size;
+    unsigned                *cq_head;
+    unsigned                *cq_tail;
+    unsigned                *cq_mask;
+    struct io_uring_cqe     *cqes;
+    unsigned                to_submit;
+    unsigned                pending;
+    int                     fixed;
+}                           t_uring;
+
+/**
+ * A buffer of the ring goes FREE -> READING -> WRITING -> FREE
+ */
+typedef enum                e_buf_state
+{
+    BUF_FREE = 0,
+    BUF_READING,
+    BUF_WRITING
+}                           t_buf_state;
+
+typedef struct              s_uring_buf
+{
+    t_buf_state             state;
+    char                    *data;
+    off_t                   offset;
+    size_t                  len;
+    size_t                  done;
+}                           t_uring_buf;
+
+/**
+ * Create the ring and map the SQ ring, CQ ring and the SQE array
+ */
+static int  uring_setup(t_uring *ring, unsigned depth)
+{
+    struct io_uring_params  p;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    if ((ring->fd = syscall(__NR_io_uring_setup, depth, &p)) == SYSCALL_ERROR)
+        return ENGINE_UNSUPPORTED;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        perror("mmap");
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring != ring->sq_ring && ring->cq_ring != MAP_FAILED)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return RETURN_ERROR;
+    }
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return RETURN_SUCCESS;
+}
+
+static void uring_close(t_uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * Register the buffers so the kernel pins them once instead of on every
+ * request. This can fail (RLIMIT_MEMLOCK), plain READ/WRITE are used then.
+ */
+static void uring_register(t_uring *ring, t_uring_buf *bufs, unsigned count, size_t block)
+{
+    struct iovec    *iov;
+    unsigned        i;
+
+    if ((iov = calloc(count, sizeof(*iov))) == NULL)
+        return;
+    for (i = 0 ; i < count ; ++i)
+    {
+        iov[i].iov_base = bufs[i].data;
+        iov[i].iov_len = block;
+    }
+    ring->fixed = (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0);
+    free(iov);
+}
+
+/**
+ * Queue the read or the write (depending on the buffer state) of what
+ * remains of buffer `index`
+ */
+static void uring_queue(t_uring *ring, t_copy_ctx *ctx, t_uring_buf *buf, unsigned index, off_t delta)
+{
+    unsigned            tail = *ring->sq_tail;
+    unsigned            slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    int                 reading = (buf->state == BUF_READING);
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (ring->fixed)
+        sqe->opcode = reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    else
+        sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = reading ? ctx->infd : ctx->outfd;
+    sqe->off = buf->offset + buf->done + (reading ? 0 : delta);
+    sqe->addr = (unsigned long)(buf->data + buf->done);
+    sqe->len = buf->len - buf->done;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->to_submit;
+}
+
+/**
+ * Handle one completion, returns RETURN_ERROR on a failed request
+ */
+static int  uring_complete(t_uring *ring, t_copy_ctx *ctx, t_uring_buf *bufs,
+                           struct io_uring_cqe *cqe, off_t delta, unsigned *inflight)
+{
+    t_uring_buf *buf = &bufs[cqe->user_data];
+
+    ++ctx->ops;
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+    {
+        uring_queue(ring, ctx, buf, cqe->user_data, delta);
+        return RETURN_SUCCESS;
+    }
+    if (cqe->res < 0 || (cqe->res == 0 && buf->state == BUF_READING))
+    {
+        fprintf(stderr, "[-] io_uring %s failed at offset %lld: %s\n",
+                buf->state == BUF_READING ? "read" : "write", (long long)buf->offset,
+                cqe->res < 0 ? strerror(-cqe->res) : "unexpected end of file");
+        return RETURN_ERROR;
+    }
+    buf->done += cqe->res;
+    if (buf->done < buf->len)
+    {
+        uring_queue(ring, ctx, buf, cqe->user_data, delta);
+        return RETURN_SUCCESS;
+    }
+    buf->done = 0;
+    if (buf->state == BUF_READING)
+    {
+        buf->state = BUF_WRITING;
+        uring_queue(ring, ctx, buf, cqe->user_data, delta);
+        return RETURN_SUCCESS;
+    }
+    ctx->bytes += buf->len;
+    buf->state = BUF_FREE;
+    --*inflight;
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Wait for the `pending` requests still in flight after a failure, the
+ * kernel may write into the buffers until they complete. If it can't be
+ * waited for, ring->pending stays > 0 and the buffers must not be freed.
+ */
+static int  uring_drain(t_uring *ring, unsigned pending)
+{
+    unsigned    head;
+
+    ring->pending = pending;
+    while (ring->pending > 0)
+    {
+        if (syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) == SYSCALL_ERROR && errno != EINTR)
+        {
+            perror("io_uring_enter");
+            return RETURN_ERROR;
+        }
+        ring->to_submit = 0;
+        head = *ring->cq_head;
+        for (; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) && ring->pending > 0 ; --ring->pending)
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Run the pipeline: every free buffer reads the next block, every block
+ * read is written back at the same relative offset, so up to `depth`
+ * reads and writes are in flight at any time.
+ */
+static int  uring_pipeline(t_uring *ring, t_copy_ctx *ctx, t_uring_buf *bufs, unsigned count,
+                           off_t in_off, off_t end, off_t delta)
+{
+    unsigned    inflight = 0, i, head;
+    size_t      block = ctx->io.block;
+    int         ret;
+
+    while (in_off < end || inflight > 0)
+    {
+        for (i = 0 ; i < count && in_off < end && inflight < ctx->uring_depth ; ++i)
+        {
+            if (bufs[i].state != BUF_FREE)
+                continue;
+            bufs[i].state = BUF_READING;
+            bufs[i].offset = in_off;
+            bufs[i].len = (size_t)(end - in_off) < block ? (size_t)(end - in_off) : block;
+            bufs[i].done = 0;
+            in_off += bufs[i].len;
+            ++inflight;
+            uring_queue(ring, ctx, &bufs[i], i, delta);
+        }
+        ++ctx->syscalls;
+        if (syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) == SYSCALL_ERROR && errno != EINTR)
+        {
+            perror("io_uring_enter");
+            uring_drain(ring, inflight);
+            return RETURN_ERROR;
+        }
+        ring->to_submit = 0;
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            ret = uring_complete(ring, ctx, bufs, &ring->cqes[head & *ring->cq_mask], delta, &inflight);
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+            if (ret == RETURN_ERROR)
+            {
+                /* The failed buffer has nothing in flight any more */
+                uring_drain(ring, inflight - 1);
+                return RETURN_ERROR;
+            }
+        }
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Copy with an io_uring pipeline of ctx->uring_buffers blocks of
+ * ctx->io.block bytes, at most ctx->uring_depth requests in flight.
+ *
+ * Requests use explicit offsets, so the input has to be a regular file.
+ * The achieved MB/s and IOPS of this file are printed to tune the queue
+ * depth (ctx counts every file of a tree copy).
+ */
+int         uring_engine(t_copy_ctx *ctx)
+{
+    t_uring     ring;
+    t_uring_buf *bufs;
+    char        *data;
+    off_t       in_off, out_off, end;
+    unsigned    i, count = ctx->uring_buffers ? ctx->uring_buffers : ctx->uring_depth;
+    unsigned long long  bytes = ctx->bytes, ops = ctx->ops;
+    double      start = clock_seconds(), elapsed;
+    int         ret;
+
+    if (file_range(ctx, &in_off, &out_off, &end) == ENGINE_UNSUPPORTED)
+        return ENGINE_UNSUPPORTED;
+    if ((ret = uring_setup(&ring, ctx->uring_depth)) != RETURN_SUCCESS)
+        return ret;
+    bufs = calloc(count, sizeof(*bufs));
+    if (bufs == NULL || posix_memalign((void **)&data, sysconf(_SC_PAGESIZE), count * ctx->io.block) != 0)
+    {
+        fprintf(stderr, "[-] Failed to allocate %u io_uring buffers\n", count);
+        free(bufs);
+        uring_close(&ring);
+        return RETURN_ERROR;
+    }
+    for (i = 0 ; i < count ; ++i)
+        bufs[i].data = data + (size_t)i * ctx->io.block;
+    uring_register(&ring, bufs, count, ctx->io.block);
+    ret = uring_pipeline(&ring, ctx, bufs, count, in_off, end, out_off - in_off);
+    elapsed = clock_seconds() - start;
+    if (ret == RETURN_SUCCESS)
+    {
+        lseek(ctx->infd, end, SEEK_SET);
+        lseek(ctx->outfd, out_off + (end - in_off), SEEK_SET);
+        printf("[~] io_uring: depth %u, %u buffers of %zu bytes%s, %.1f MB/s, %.0f IOPS\n",
+               ctx->uring_depth, count, ctx->io.block, ring.fixed ? " (registered)" : "",
+               elapsed > 0 ? (ctx->bytes - bytes) / elapsed / 1e6 : 0.0,
+               elapsed > 0 ? (ctx->ops - ops) / elapsed : 0.0);
+    }
+    uring_close(&ring);
+    /* Leaked rather than handed back while the kernel may still fill them */
+    if (ring.pending == 0)
+    {
+        free(data);
+        free(bufs);
+    }
+    return ret;
+}
@@ -0,0 +1,218 @@
+/**
+ * Checkpoints of a range sweep: the bitmap of the completed chunks and
+ * the reduction of their results, so that a sweep killed (or a node
+ * rebooted) only loses the chunks that were in progress
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "collatz.h"
+
+/**
+ * A worker which died in the middle of a commit (reaped already, or
+ * exited and not reaped yet) never makes its seq even again
+ */
+static int          slot_dead(const t_slot *slot)
+{
+    siginfo_t       info;
+
+    if (__atomic_load_n(&slot->dead, __ATOMIC_ACQUIRE))
+        return 1;
+    info.si_pid = 0;
+    return slot->pid > 0 && waitid(P_PID, slot->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0
+        && info.si_pid == slot->pid;
+}
+
+/**
+ * Reduce the results of the completed chunks (and copy their bitmap if
+ * `bitmap` isn't NULL) while the workers carry on. A copy is retried
+ * until no worker committed a chunk in the middle of it, so the bitmap
+ * matches the results. The slots of the workers which died in the middle
+ * of a commit are left out, their count is returned.
+ */
+unsigned            sweep_snapshot(const t_sweep *sweep, t_result *total, uint64_t *bitmap)
+{
+    uint64_t        seqs[sweep->workers];
+    unsigned        i, torn;
+    int             consistent;
+
+    do
+    {
+        *total = sweep->resumed;
+        for (i = 0, torn = 0 ; i < sweep->workers ; ++i)
+        {
+            while ((seqs[i] = __atomic_load_n(&sweep->slots[i].seq, __ATOMIC_ACQUIRE)) % 2 == 1
+                   && !slot_dead(&sweep->slots[i]))
+                sched_yield();
+            if (seqs[i] % 2 == 1)
+                ++torn;
+            else
+                reduce(total, &sweep->slots[i].result);
+        }
+        if (bitmap != NULL)
+            memcpy(bitmap, sweep->done, (sweep->chunks + 63) / 64 * sizeof(*bitmap));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        for (i = 0, consistent = 1 ; i < sweep->workers ; ++i)
+            consistent &= (__atomic_load_n(&sweep->slots[i].seq, __ATOMIC_RELAXED) == seqs[i]);
+    } while (!consistent);
+    return torn;
+}
+
+static int          read_full(int fd, void *data, size_t len)
+{
+    ssize_t         n;
+    size_t          done = 0;
+
+    while (done < len)
+    {
+        if ((n = read(fd, (char *)data + done, len - done)) > 0)
+            done += n;
+        else if (n == 0 || errno != EINTR)
+            return RETURN_FAILURE;
+    }
+    return RETURN_SUCCESS;
+}
+
+static int          write_full(int fd, const void *data, size_t len)
+{
+    ssize_t         n;
+    size_t          done = 0;
+
+    while (done < len)
+    {
+        if ((n = write(fd, (const char *)data + done, len - done)) != SYSCALL_ERROR)
+            done += n;
+        else if (errno != EINTR)
+            return RETURN_FAILURE;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * The results of verify mode depend on the sieve, so on the table size
+ */
+static void         checkpoint_header(const t_sweep *sweep, t_checkpoint *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->result_size = sizeof(t_result);
+    header->verify = sweep->verify;
+    header->jump_bits = (sweep->verify ? sweep->jump.bits : 0);
+    header->lo = sweep->lo;
+    header->hi = sweep->hi;
+    header->chunk = sweep->chunk;
+}
+
+static uint64_t     count_done(const uint64_t *bitmap, uint64_t chunks)
+{
+    uint64_t        i, count = 0;
+
+    for (i = 0 ; i < (chunks + 63) / 64 ; ++i)
+        count += __builtin_popcountll(bitmap[i]);
+    return count;
+}
+
+/**
+ * Resume from `path` if it exists: mark its chunks as done and keep its
+ * results in `resumed`. `elapsed` is the time spent by the previous runs.
+ * Fails if the checkpoint is from another sweep.
+ */
+int                 checkpoint_load(t_sweep *sweep, const char *path, double *elapsed)
+{
+    t_checkpoint    expected, header;
+    int             fd, ret;
+
+    *elapsed = 0;
+    if ((fd = open(path, O_RDONLY)) == SYSCALL_ERROR)
+    {
+        if (errno == ENOENT)
+            return RETURN_SUCCESS;
+        perror(path);
+        return RETURN_FAILURE;
+    }
+    checkpoint_header(sweep, &expected);
+    ret = read_full(fd, &header, sizeof(header));
+    if (ret == RETURN_SUCCESS)
+        ret = read_full(fd, sweep->done, (sweep->chunks + 63) / 64 * sizeof(*sweep->done));
+    close(fd);
+    if (ret != RETURN_SUCCESS || memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0
+        || header.result_size != expected.result_size || header.verify != expected.verify
+        || header.jump_bits != expected.jump_bits || header.lo != expected.lo || header.hi != expected.hi
+        || header.chunk != expected.chunk || count_done(sweep->done, sweep->chunks) != header.chunks_done)
+    {
+        fprintf(stderr, "[-] %s is not a checkpoint of this sweep (range, chunk, -v and -t must match)\n", path);
+        return RETURN_FAILURE;
+    }
+    sweep->resumed = header.total;
+    *elapsed = header.elapsed;
+    fprintf(stderr, "[+] Resuming from %s: %llu/%llu chunks done in %.1f s\n", path,
+            (unsigned long long)header.chunks_done, (unsigned long long)sweep->chunks, header.elapsed);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Write a snapshot to `path`.tmp, sync it and rename it over `path`, so a
+ * crash leaves either the previous checkpoint or the new one
+ */
+int                 checkpoint_save(const t_sweep *sweep, const char *path, double elapsed)
+{
+    t_checkpoint    header;
+    char            tmp[PATH_MAX], dir[PATH_MAX];
+    size_t          size = (sweep->chunks + 63) / 64 * sizeof(*sweep->done);
+    uint64_t        *bitmap;
+    int             fd, ret;
+
+    if ((bitmap = malloc(size)) == NULL)
+    {
+        perror("malloc");
+        return RETURN_FAILURE;
+    }
+    checkpoint_header(sweep, &header);
+    /* The bitmap may hold chunks whose results died with a worker */
+    if (sweep_snapshot(sweep, &header.total, bitmap) > 0)
+    {
+        fprintf(stderr, "[-] A worker died in the middle of a commit, keeping the previous checkpoint %s\n", path);
+        free(bitmap);
+        return RETURN_FAILURE;
+    }
+    header.chunks_done = count_done(bitmap, sweep->chunks);
+    header.elapsed = elapsed;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == SYSCALL_ERROR)
+    {
+        perror(tmp);
+        free(bitmap);
+        return RETURN_FAILURE;
+    }
+    ret = write_full(fd, &header, sizeof(header));
+    if (ret == RETURN_SUCCESS)
+        ret = write_full(fd, bitmap, size);
+    if (ret == RETURN_SUCCESS && fsync(fd) == SYSCALL_ERROR)
+        ret = RETURN_FAILURE;
+    close(fd);
+    free(bitmap);
+    if (ret == RETURN_SUCCESS && rename(tmp, path) == SYSCALL_ERROR)
+        ret = RETURN_FAILURE;
+    if (ret != RETURN_SUCCESS)
+    {
+        fprintf(stderr, "[-] Failed to save the checkpoint %s\n", path);
+        perror(tmp);
+        unlink(tmp);
+        return RETURN_FAILURE;
+    }
+    /** The rename itself must reach the disk */
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) != SYSCALL_ERROR)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    return RETURN_SUCCESS;
+}
@@ -2,37 +2,153 @@
  * Made by Erwan Dupard (CSUSM Student)
  * 2018 - 02 - 06   10:48 PM
  */
-#include <limits.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "collatz.h"
 
 /**
- * Some Macro used for the project
+ * Generate the sequence of a number too big for 64 bits
  */
-#define IN_INTERVAL(x)  (x >= 1 && x < INT_MAX && (3*x+1 >= 0 && 3*x+1 <= INT_MAX))
-#define RETURN_SUCCESS  (0)
-#define RETURN_FAILURE  (1)
-#define SYSCALL_ERROR   (-1)
-#define ODD(x)          (x % 2 == 1)
+static int      generate_big(t_output *out, t_bignum *big)
+{
+    int         ret = RETURN_SUCCESS;
+
+    out_bignum(out, big);
+    while (ret == RETURN_SUCCESS && !bignum_is_one(big))
+    {
+        ret = bignum_step(big);
+        out_separator(out);
+        out_bignum(out, big);
+    }
+    bignum_free(big);
+    return out_flush(out) | ret;
+}
 
 /**
- * Function generation the sequence with the printf() stdlib call
+ * Function generating the sequence into the `out` buffer, switching to
+ * bignums when 3n + 1 overflows 64 bits
  */
-int             generate_sequence(unsigned int base)
+int             generate_sequence(t_output *out, uint64_t base)
 {
-    printf("%d", base);
-    if (base <= 1)
-        return RETURN_SUCCESS;
-    else
-        printf(", ");
-    if (ODD(base))
-        base = 3 * base + 1;
-    else
-        base = base / 2;
-    return generate_sequence(base);
+    t_bignum    big = {0};
+
+    for (;;)
+    {
+        out_u64(out, base);
+        if (base <= 1)
+            return out_flush(out);
+        out_separator(out);
+        if (ODD(base) && base > COLLATZ_LIMIT(uint64_t))
+        {
+            if (bignum_from_u128(&big, 3 * (t_u128)base + 1) != RETURN_SUCCESS)
+                return RETURN_FAILURE;
+            return generate_big(out, &big);
+        }
+        if (ODD(base))
+            base = 3 * base + 1;
+        else
+            base = base / 2;
+    }
+}
+
+/**
+ * Convert `str` to a number > 0, returns 0 if it is not valid
+ */
+static uint64_t     parse_number(const char *str)
+{
+    char            *end;
+    uint64_t        n;
+
+    errno = 0;
+    n = strtoull(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || *str == '-')
+        return 0;
+    return n;
+}
+
+static void         usage(const char *name)
+{
+    fprintf(stderr, "[-] USAGE: %s [-b] <start_number>\n", name);
+    fprintf(stderr, "           %s [-j workers] [-c chunk] [-m cache] [-k kernel] [-t bits] [-v]\n"
+            "           %*s [-C file] [-i seconds] [-p seconds] <lo> <hi>    (stopping times of [lo, hi))\n",
+            name, (int)strlen(name), "");
+    fprintf(stderr, "    -b          write the sequence as LEB128 varints instead of decimal\n");
+    fprintf(stderr, "    -m cache    share the stopping times of the seeds below `cache`, 0 to disable (default: %d)\n",
+            CACHE_DEFAULT);
+    fprintf(stderr, "    -k kernel   auto, scalar, avx2, avx512 or jump (default: auto, the widest the CPU has)\n");
+    fprintf(stderr, "    -t bits     jump tables of 2^bits entries, at most %d (default: 0, sized to half the L2 cache)\n",
+            JUMP_MAX_BITS);
+    fprintf(stderr, "    -v          only verify that every seed drops below itself (jump kernel and sieve)\n");
+    fprintf(stderr, "    -C file     checkpoint the sweep to `file`, and resume from it if it exists\n");
+    fprintf(stderr, "    -i seconds  time between two checkpoints (default: %d)\n", CHECKPOINT_DEFAULT);
+    fprintf(stderr, "    -p seconds  report the throughput on stderr every `seconds`, 0 to disable (default: 0)\n");
+}
+
+static int          parse_options(t_options *options, int argc, char **argv)
+{
+    long            online = sysconf(_SC_NPROCESSORS_ONLN);
+    int             opt;
+
+    options->workers = (online > 0 ? online : 1);
+    options->chunk = CHUNK_DEFAULT;
+    options->cache = CACHE_DEFAULT;
+    options->kernel = kernel_from_name("auto");
+    options->jump_bits = 0;
+    options->verify = 0;
+    options->binary = 0;
+    options->checkpoint = NULL;
+    options->checkpoint_interval = CHECKPOINT_DEFAULT;
+    options->progress = 0;
+    while ((opt = getopt(argc, argv, "j:c:m:k:t:vbC:i:p:")) != -1)
+    {
+        if (opt == 'b' || opt == 'v')
+        {
+            *(opt == 'b' ? &options->binary : &options->verify) = 1;
+            continue;
+        }
+        if (opt == 't' && (options->jump_bits = parse_number(optarg)) <= JUMP_MAX_BITS
+            && (options->jump_bits > 0 || strcmp(optarg, "0") == 0))
+            continue;
+        if (opt == 'C')
+        {
+            options->checkpoint = optarg;
+            continue;
+        }
+        if (opt == 'i' && (options->checkpoint_interval = parse_number(optarg)) > 0)
+            continue;
+        if (opt == 'p' && ((options->progress = parse_number(optarg)) > 0 || strcmp(optarg, "0") == 0))
+            continue;
+        if (opt == 'k' && (options->kernel = kernel_from_name(optarg)) != KERNEL_COUNT)
+            continue;
+        if (opt == 'm' && ((options->cache = parse_number(optarg)) > 0 || strcmp(optarg, "0") == 0))
+            continue;
+        if (opt == 'j' && (options->workers = parse_number(optarg)) > 0 && options->workers <= 4096)
+            continue;
+        if (opt == 'c' && (options->chunk = parse_number(optarg)) > 0)
+            continue;
+        return RETURN_FAILURE;
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Range mode, the seeds of [lo, hi) are split between the workers
+ */
+static int          range_mode(const t_options *options, char **argv)
+{
+    uint64_t        lo = parse_number(argv[0]), hi = parse_number(argv[1]);
+
+    if (lo == 0 || hi <= lo)
+    {
+        printf("[-] Please, enter a valid range (1 <= lo < hi)\n");
+        return RETURN_FAILURE;
+    }
+    return sweep_range(lo, hi, options);
 }
 
 /**
@@ -41,17 +157,24 @@ int             generate_sequence(unsigned int base)
 int                 main(int argc, char **argv)
 {
     int             pid = 0;
-    int             base = 0;
+    t_bignum        base = {0};
+    t_u128          value = 0;
+    t_options       options;
+    t_output        *out;
+    FILE            *info;
 
-    if (argc < 2)
+    if (parse_options(&options, argc, argv) != RETURN_SUCCESS || argc - optind < 1 || argc - optind > 2)
     {
-        fprintf(stderr, "[-] USAGE: %s <start_number>\n", argv[0]);
+        usage(argv[0]);
         return RETURN_FAILURE;
     }
-    /** Convert const char * -> int  */
+    if (argc - optind == 2)
+        return range_mode(&options, argv + optind);
+    /** The messages must not end up in the middle of binary output */
+    info = (options.binary ? stderr : stdout);
+    /** Convert const char * -> number, any size */
     /** Check if base is > 0  */
-    base = atoi(argv[1]);
-    if (!(IN_INTERVAL(base)))
+    if (bignum_parse(&base, argv[optind]) != RETURN_SUCCESS || (base.count == 1 && base.limbs[0] == 0))
     {
         printf("[-] Please, enter a valid number (>= 1)\n");
         return RETURN_FAILURE;
@@ -59,14 +182,27 @@ int                 main(int argc, char **argv)
     /** Process creation */
     if ((pid = fork()) == 0)
     { /** Here, we are in the child process, so generate the sequence */
-        printf("[+] Process created .. pid=%d\n", getpid());
-        return generate_sequence((unsigned int)base);
+        fprintf(info, "[+] Process created .. pid=%d\n", getpid());
+        fflush(info);
+        if ((out = malloc(sizeof(*out))) == NULL)
+        {
+            perror("malloc");
+            return RETURN_FAILURE;
+        }
+        out_init(out, STDOUT_FILENO, options.binary);
+        if (bignum_to_u128(&base, &value) && (value >> 64) == 0)
+        {
+            bignum_free(&base);
+            return generate_sequence(out, value);
+        }
+        return generate_big(out, &base);
     } 
     else if (pid > 0)
     { /** Here, we are in the parent process, so wait for the son process to complete */
         wait(NULL);
         fflush(stdout);  /* Make sure to flush after all the call to printf (in case printf didn't do it by itself */
-        printf("\n[+] Finished job !\n");
+        fprintf(info, "\n[+] Finished job !\n");
+        bignum_free(&base);
     }
     else
     { /** Error at the fork() system call */
@@ -0,0 +1,319 @@
+/**
+ * Made by Erwan Dupard (CSUSM Student)
+ * 2018 - 02 - 06   10:48 PM
+ */
+#ifndef COLLATZ_H_
+# define COLLATZ_H_
+
+# include <stddef.h>
+# include <stdint.h>
+# include <sys/types.h>
+
+/**
+ * Some Macro used for the project
+ */
+# define RETURN_SUCCESS  (0)
+# define RETURN_FAILURE  (1)
+# define SYSCALL_ERROR   (-1)
+# define ODD(x)          (x % 2 == 1)
+
+/**
+ * Hot loop, instantiated for each word width (uint64_t, unsigned __int128):
+ * step `n` until it reaches 1, `stop` holds after a step, or 3n + 1 would
+ * overflow `type`. In that last case n is left odd and above
+ * COLLATZ_LIMIT(type), for the caller to promote it to a wider type.
+ */
+# define COLLATZ_LIMIT(type)     (((type)~(type)0 - 1) / 3)
+# define COLLATZ_LOOP(type, n, steps, peak, stop)                           \
+    while ((n) != 1 && !(ODD(n) && (n) > COLLATZ_LIMIT(type)))              \
+    {                                                                       \
+        (n) = ODD(n) ? 3 * (n) + 1 : (n) >> 1;                              \
+        (peak) = ((n) > (peak) ? (n) : (peak));                             \
+        ++(steps);                                                          \
+        if (stop)                                                           \
+            break;                                                          \
+    }
+
+/**
+ * Arbitrary precision fallback, little endian limbs in base 10^9
+ */
+# define BIGNUM_BASE     (1000000000U)
+
+typedef unsigned __int128   t_u128;
+
+typedef struct          s_bignum
+{
+    uint32_t            *limbs;
+    size_t              count;
+    size_t              size;
+}                       t_bignum;
+
+/**
+ * Sequence output, formatted in a OUTPUT_BUFFER bytes buffer
+ */
+# define OUTPUT_BUFFER   (1 << 16)
+
+typedef struct          s_output
+{
+    int                 fd;
+    int                 binary;
+    int                 failed;
+    size_t              len;
+    char                buffer[OUTPUT_BUFFER];
+}                       t_output;
+
+/**
+ * Range mode: seeds are handed out CHUNK_DEFAULT at a time, the stopping
+ * times are counted in HISTOGRAM_BINS bins of HISTOGRAM_WIDTH steps
+ */
+# define CHUNK_DEFAULT   (1 << 16)
+# define HISTOGRAM_BINS  (128)
+# define HISTOGRAM_WIDTH (8)
+# define CACHE_LINE      (64)
+
+/**
+ * Stopping times (and peaks) of the seeds below the cache bound are kept
+ * in shared memory, a walk stops at the first cached value it meets
+ */
+# define CACHE_DEFAULT   (1 << 20)
+
+/**
+ * Jump tables: entry b < 2^bits holds what `bits` steps of the shortcut
+ * map T(n) = n / 2 or (3n + 1) / 2 do to the low bits of n (at most
+ * 2^JUMP_MAX_BITS entries, T^k(b) < 3^k has to fit in 32 bits).
+ * `ratio` and `low` are the max and min of 3^c / 2^i over the block,
+ * bounding its values from above (peaks) and below (glides), the float
+ * rounding being covered by JUMP_MARGIN.
+ */
+# define JUMP_MAX_BITS   (20)
+# define JUMP_MARGIN     (1e-5)
+
+typedef struct          s_jump_entry
+{
+    uint32_t            value;
+    uint32_t            maxval;
+    float               ratio;
+    float               low;
+    uint8_t             odd;
+    uint8_t             prune;
+}                       t_jump_entry;
+
+typedef struct          s_jump
+{
+    unsigned            bits;
+    uint64_t            mask;
+    uint64_t            limit;
+    uint64_t            pruned;
+    uint64_t            pow3[JUMP_MAX_BITS + 1];
+    t_jump_entry        *entries;
+}                       t_jump;
+
+/**
+ * Range kernels: one seed at a time, 4/8 seeds in the 64 bits lanes of
+ * AVX2/AVX-512 registers, or k steps at a time with the jump tables.
+ * KERNEL_AUTO picks the widest SIMD kernel the CPU has.
+ */
+typedef enum            e_kernel_id
+{
+    KERNEL_AUTO = 0,
+    KERNEL_SCALAR,
+    KERNEL_AVX2,
+    KERNEL_AVX512,
+    KERNEL_JUMP,
+    KERNEL_COUNT
+}                       t_kernel_id;
+
+/**
+ * What one worker found over the seeds it processed. The checksum is a
+ * sum of per-seed hashes, so it doesn't depend on which worker got which
+ * chunk. In verify mode the steps are glides (steps to drop below the
+ * seed) and `pruned` counts the seeds skipped by the sieve.
+ */
+typedef struct          s_result
+{
+    uint64_t            seeds;
+    uint64_t            steps;
+    uint64_t            max_steps;
+    uint64_t            max_steps_seed;
+    t_u128              peak;
+    uint64_t            peak_seed;
+    uint64_t            checksum;
+    uint64_t            walked;
+    uint64_t            hits;
+    uint64_t            pruned;
+    uint64_t            histogram[HISTOGRAM_BINS];
+}                       t_result;
+
+/**
+ * A worker's results over the chunks it completed. `seq` is odd while the
+ * worker adds a chunk in, so the parent can copy a consistent snapshot
+ * without stopping it. `current` is 1 + the chunk it is on (0 if none),
+ * back on the ring if the worker dies. `pid` is
+ * the worker's, and `dead` is set once it was reaped in the middle of a
+ * commit: its seq stays odd, the snapshots skip its torn results.
+ */
+typedef struct          s_slot
+{
+    uint64_t            seq;
+    uint64_t            current;
+    pid_t               pid;
+    int                 dead;
+    t_result            result;
+}                       t_slot;
+
+/**
+ * Bounded ring the supervisor feeds the chunk indexes through, popped by
+ * the workers (each cell's `seq` says whose turn it is). The supervisor
+ * tops it up and reaps the workers every SUPERVISE_TICK ms, workers
+ * finding it empty nap RING_NAP ns and leave once it is also `closed`.
+ */
+# define RING_SIZE       (1 << 12)
+# define RING_NAP        (100000)
+# define SUPERVISE_TICK  (10)
+
+typedef struct          s_ring_cell
+{
+    uint64_t            seq;
+    uint64_t            chunk;
+}                       t_ring_cell;
+
+typedef struct          s_ring
+{
+    uint64_t            head __attribute__((aligned(CACHE_LINE)));
+    uint64_t            tail __attribute__((aligned(CACHE_LINE)));
+    int                 closed;
+    t_ring_cell         cells[RING_SIZE];
+}                       t_ring;
+
+/**
+ * State of a range sweep, shared with the workers (MAP_SHARED).
+ * The bits of `done` (when checkpointing) mark the completed chunks.
+ * cache_steps[n] is 0 until the stopping time of n is known, it is stored
+ * after cache_peaks[n]. `resumed` is what a checkpoint brought back.
+ */
+typedef struct          s_sweep
+{
+    uint64_t            lo;
+    uint64_t            hi;
+    uint64_t            chunk;
+    uint64_t            chunks;
+    unsigned            workers;
+    t_kernel_id         kernel;
+    int                 verify;
+    uint64_t            *done;
+    t_result            resumed;
+    t_jump              jump;
+    uint64_t            cache_bound;
+    uint16_t            *cache_steps;
+    uint64_t            *cache_peaks;
+    t_ring              ring;
+    t_slot              slots[] __attribute__((aligned(CACHE_LINE)));
+}                       t_sweep;
+
+/**
+ * The seeds of the chunk a worker is on, [seed, end)
+ */
+typedef struct          s_cursor
+{
+    uint64_t            seed;
+    uint64_t            end;
+}                       t_cursor;
+
+/**
+ * Checkpoint file: this header, then the `done` bitmap. It is rewritten
+ * to a temporary file renamed over the previous one every
+ * CHECKPOINT_DEFAULT seconds. The sweep parameters must match to resume.
+ */
+# define CHECKPOINT_MAGIC    "CLZCKPT1"
+# define CHECKPOINT_DEFAULT  (60)
+
+typedef struct          s_checkpoint
+{
+    char                magic[8];
+    uint32_t            result_size;
+    uint32_t            verify;
+    uint32_t            jump_bits;
+    uint32_t            reserved;
+    uint64_t            lo;
+    uint64_t            hi;
+    uint64_t            chunk;
+    uint64_t            chunks_done;
+    double              elapsed;
+    t_result            total;
+}                       t_checkpoint;
+
+/**
+ * Command line settings (`jump_bits` 0 sizes the tables from the L2 cache,
+ * intervals are in seconds, a `progress` of 0 means no reports)
+ */
+typedef struct          s_options
+{
+    uint64_t            workers;
+    uint64_t            chunk;
+    uint64_t            cache;
+    t_kernel_id         kernel;
+    unsigned            jump_bits;
+    int                 verify;
+    int                 binary;
+    const char          *checkpoint;
+    uint64_t            checkpoint_interval;
+    uint64_t            progress;
+}                       t_options;
+
+typedef struct          s_kernel
+{
+    const char          *name;
+    int                 (*run)(t_sweep *sweep, t_result *result, t_cursor *cursor);
+    const char          *cpu_feature;
+}                       t_kernel;
+
+/* collatz.c */
+int                     generate_sequence(t_output *out, uint64_t base);
+
+/* output.c */
+void                    out_init(t_output *out, int fd, int binary);
+int                     out_flush(t_output *out);
+void                    out_u64(t_output *out, uint64_t n);
+void                    out_bignum(t_output *out, const t_bignum *big);
+void                    out_separator(t_output *out);
+
+/* width.c */
+int                     bignum_parse(t_bignum *big, const char *str);
+int                     bignum_from_u128(t_bignum *big, t_u128 value);
+int                     bignum_to_u128(const t_bignum *big, t_u128 *value);
+int                     bignum_is_one(const t_bignum *big);
+int                     bignum_step(t_bignum *big);
+void                    bignum_print(const t_bignum *big);
+void                    bignum_free(t_bignum *big);
+void                    print_u128(t_u128 value);
+uint64_t                walk_wide(uint64_t value, uint64_t *steps, t_u128 *peak);
+
+/* range.c */
+int                     sweep_range(uint64_t lo, uint64_t hi, const t_options *options);
+void                    record_seed(t_result *result, uint64_t seed, uint64_t steps, t_u128 peak);
+void                    reduce(t_result *to, const t_result *from);
+int                     walk_from(const t_sweep *sweep, t_result *result, uint64_t seed,
+                                  uint64_t n, uint64_t steps, uint64_t peak);
+int                     next_seed(t_cursor *cursor, uint64_t *seed);
+int                     kernel_scalar(t_sweep *sweep, t_result *result, t_cursor *cursor);
+
+/* simd.c */
+const t_kernel          *kernel_get(t_kernel_id id);
+t_kernel_id             kernel_from_name(const char *name);
+int                     kernel_avx2(t_sweep *sweep, t_result *result, t_cursor *cursor);
+int                     kernel_avx512(t_sweep *sweep, t_result *result, t_cursor *cursor);
+
+/* pool.c */
+int                     pool_run(t_sweep *sweep, const t_options *options, double previous, double *elapsed);
+
+/* checkpoint.c */
+unsigned                sweep_snapshot(const t_sweep *sweep, t_result *total, uint64_t *bitmap);
+int                     checkpoint_load(t_sweep *sweep, const char *path, double *elapsed);
+int                     checkpoint_save(const t_sweep *sweep, const char *path, double elapsed);
+
+/* jump.c */
+int                     jump_init(t_jump *jump, unsigned bits);
+void                    jump_free(t_jump *jump);
+int                     kernel_jump(t_sweep *sweep, t_result *result, t_cursor *cursor);
+
+#endif /* !COLLATZ_H_ */
@@ -0,0 +1,6 @@
+#!/bin/bash
+# Compilation script
+
+
+gcc *.c -o collatz -O2 -Wall -Wextra -lm
+rm -rf *.o
@@ -0,0 +1,203 @@
+/**
+ * k-bit jump tables: with n = 2^k * a + b, k steps of the shortcut map
+ * T(n) = n / 2 or (3n + 1) / 2 give T^k(n) = 3^c(b) * a + T^k(b), c(b)
+ * being the odd steps taken from b. One lookup and one multiply-add
+ * replace k steps, the 2^k sieve skips the seeds known to drop below
+ * themselves when only verifying convergence.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "collatz.h"
+
+/**
+ * Largest table fitting in half of the L2 cache (the other half is for
+ * the data of the walk)
+ */
+static unsigned     jump_auto_bits(void)
+{
+    long            l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    unsigned        bits = 1;
+
+    if (l2 <= 0)
+        l2 = 1 << 20;
+    while (bits < JUMP_MAX_BITS && (sizeof(t_jump_entry) << (bits + 1)) <= (size_t)l2 / 2)
+        ++bits;
+    return bits;
+}
+
+/**
+ * Walk the k shortcut steps of every residue b to fill its entry
+ */
+static void         jump_fill(t_jump *jump, uint64_t b)
+{
+    t_jump_entry    *entry = &jump->entries[b];
+    uint64_t        x = b;
+    int64_t         gap;
+    double          ratio;
+    unsigned        i, c = 0;
+
+    entry->ratio = 0;
+    entry->low = 1;
+    entry->maxval = 0;
+    entry->prune = 0;
+    for (i = 1 ; i <= jump->bits ; ++i)
+    {
+        if (ODD(x))
+        {
+            x = (3 * x + 1) / 2;
+            ++c;
+        }
+        else
+            x /= 2;
+        ratio = jump->pow3[c] / (double)(1ULL << i);
+        entry->ratio = (ratio > entry->ratio ? ratio : entry->ratio);
+        entry->low = (ratio < entry->low ? ratio : entry->low);
+        entry->maxval = (x > entry->maxval ? x : entry->maxval);
+        /* T^i(n) - n = (3^c - 2^i) * 2^(k - i) * a + T^i(b) - b, negative for every a >= 1 (only if 3^c < 2^i) */
+        if (jump->pow3[c] >= 1ULL << i)
+            continue;
+        gap = (int64_t)(((1ULL << i) - jump->pow3[c]) << (jump->bits - i));
+        if (gap > (int64_t)x - (int64_t)b)
+            entry->prune = 1;
+    }
+    entry->odd = c;
+    entry->value = x;
+    jump->pruned += entry->prune;
+}
+
+/**
+ * Build the 2^bits entries table (bits == 0 picks it from the L2 size)
+ */
+int                 jump_init(t_jump *jump, unsigned bits)
+{
+    uint64_t        b;
+    unsigned        i;
+
+    jump->bits = (bits > 0 ? bits : jump_auto_bits());
+    jump->mask = (1ULL << jump->bits) - 1;
+    jump->pruned = 0;
+    for (i = 0, jump->pow3[0] = 1 ; i < jump->bits ; ++i)
+        jump->pow3[i + 1] = jump->pow3[i] * 3;
+    /* Every value of a block stays under n * 1.5^k + 3^k, keep 3x + 1 of it in 64 bits */
+    jump->limit = (uint64_t)(ldexp(1.0, 62) / pow(1.5, jump->bits)) - jump->pow3[jump->bits];
+    if ((jump->entries = malloc(sizeof(*jump->entries) << jump->bits)) == NULL)
+    {
+        perror("malloc");
+        return RETURN_FAILURE;
+    }
+    for (b = 0 ; b <= jump->mask ; ++b)
+        jump_fill(jump, b);
+    return RETURN_SUCCESS;
+}
+
+void                jump_free(t_jump *jump)
+{
+    free(jump->entries);
+    jump->entries = NULL;
+}
+
+/**
+ * The k steps of one block one at a time, when the block may hold a new
+ * peak (or crosses `floor` in verify mode)
+ */
+static uint64_t     jump_block_steps(const t_jump *jump, uint64_t n, uint64_t *steps, uint64_t *peak, uint64_t floor)
+{
+    unsigned        i;
+
+    for (i = 0 ; i < jump->bits && n >= floor ; ++i)
+    {
+        if (ODD(n))
+        {
+            n = 3 * n + 1;
+            *peak = (n > *peak ? n : *peak);
+            ++*steps;
+        }
+        n >>= 1;
+        ++*steps;
+    }
+    return n;
+}
+
+/**
+ * Stopping time mode: jump while n >= 2^k (T^i(n) can't reach 1 in the
+ * middle of a block) and the block fits in 64 bits. A block is only
+ * walked step by step if its upper bound 2 * (ratio * n + maxval) could
+ * beat the peak, so the peak stays exact. walk_from() finishes the walk.
+ */
+static int          jump_seed(const t_sweep *sweep, t_result *result, uint64_t seed)
+{
+    const t_jump        *jump = &sweep->jump;
+    const t_jump_entry  *entry;
+    uint64_t            n = seed, steps = 0, peak = seed;
+
+    while (n > jump->mask && n <= jump->limit)
+    {
+        entry = &jump->entries[n & jump->mask];
+        if (2.0 * (entry->ratio * (double)n + entry->maxval) * (1.0 + JUMP_MARGIN) >= (double)peak)
+            n = jump_block_steps(jump, n, &steps, &peak, 0);
+        else
+        {
+            n = (n >> jump->bits) * jump->pow3[entry->odd] + entry->value;
+            steps += jump->bits + entry->odd;
+        }
+        /* Below its seed and the cache bound, walk_from() finds the rest cached */
+        if (n < seed && n < sweep->cache_bound)
+            break;
+    }
+    return walk_from(sweep, result, seed, n, steps, peak);
+}
+
+/**
+ * Verify mode: only check that `seed` drops below itself (every smaller
+ * seed being verified too), and count its glide. Seeds >= 2^k whose
+ * residue is pruned by the sieve are known to drop. A block is jumped
+ * over when its lower bound (n - b) * low stays above the seed, else it
+ * is stepped to find where the glide ends.
+ */
+static int          verify_seed(const t_sweep *sweep, t_result *result, uint64_t seed)
+{
+    const t_jump        *jump = &sweep->jump;
+    const t_jump_entry  *entry;
+    uint64_t            n = seed, glide = 0, peak = seed;
+    t_u128              wide_peak = 0;
+
+    if (seed > jump->mask && jump->entries[seed & jump->mask].prune)
+    {
+        ++result->seeds;
+        ++result->pruned;
+        return RETURN_SUCCESS;
+    }
+    while (seed > 1 && n >= seed)
+    {
+        if (n > jump->mask && n <= jump->limit)
+        {
+            entry = &jump->entries[n & jump->mask];
+            if ((double)(n & ~jump->mask) * entry->low * (1.0 - JUMP_MARGIN) >= (double)seed)
+            {
+                n = (n >> jump->bits) * jump->pow3[entry->odd] + entry->value;
+                glide += jump->bits + entry->odd;
+            }
+            else
+                n = jump_block_steps(jump, n, &glide, &peak, seed);
+            continue;
+        }
+        /* Outside of the tables, until it drops or they apply again */
+        COLLATZ_LOOP(uint64_t, n, glide, peak, n < seed || (n > jump->mask && n <= jump->limit));
+        if (ODD(n) && n > COLLATZ_LIMIT(uint64_t) && (n = walk_wide(n, &glide, &wide_peak)) == 0)
+            return RETURN_FAILURE;
+    }
+    record_seed(result, seed, glide, 0);
+    return RETURN_SUCCESS;
+}
+
+int                 kernel_jump(t_sweep *sweep, t_result *result, t_cursor *cursor)
+{
+    uint64_t        seed;
+    int             ret = RETURN_SUCCESS;
+
+    while (ret == RETURN_SUCCESS && next_seed(cursor, &seed))
+        ret = (sweep->verify ? verify_seed(sweep, result, seed) : jump_seed(sweep, result, seed));
+    return ret;
+}
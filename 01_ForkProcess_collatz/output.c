@@ -0,0 +1,152 @@
+/**
+ * Buffered sequence output: numbers are formatted straight into a big
+ * buffer which is flushed with a few large write() calls, in decimal or
+ * as LEB128 varints (-b) for the analysis tools
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "collatz.h"
+
+static const char   digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+void                out_init(t_output *out, int fd, int binary)
+{
+    out->fd = fd;
+    out->binary = binary;
+    out->failed = 0;
+    out->len = 0;
+}
+
+/**
+ * Write the buffer out, returns RETURN_FAILURE if any write failed so far
+ */
+int                 out_flush(t_output *out)
+{
+    ssize_t         n;
+    size_t          done = 0;
+
+    while (!out->failed && done < out->len)
+    {
+        if ((n = write(out->fd, out->buffer + done, out->len - done)) != SYSCALL_ERROR)
+            done += n;
+        else if (errno != EINTR)
+        {
+            perror("write");
+            out->failed = 1;
+        }
+    }
+    out->len = 0;
+    return out->failed ? RETURN_FAILURE : RETURN_SUCCESS;
+}
+
+/**
+ * Make room for `len` more bytes in the buffer
+ */
+static char         *out_reserve(t_output *out, size_t len)
+{
+    if (out->len + len > sizeof(out->buffer))
+        out_flush(out);
+    return out->buffer + out->len;
+}
+
+/**
+ * Decimal digits of `n`, two at a time from the end, zero padded to
+ * `width`. Returns the length.
+ */
+static size_t       format_u64(char *str, uint64_t n, size_t width)
+{
+    char            digits[20];
+    size_t          len = sizeof(digits);
+
+    for (; n >= 100 ; n /= 100)
+    {
+        len -= 2;
+        memcpy(digits + len, digit_pairs + (n % 100) * 2, 2);
+    }
+    if (n >= 10)
+    {
+        len -= 2;
+        memcpy(digits + len, digit_pairs + n * 2, 2);
+    }
+    else
+        digits[--len] = '0' + n;
+    while (sizeof(digits) - len < width)
+        digits[--len] = '0';
+    memcpy(str, digits + len, sizeof(digits) - len);
+    return sizeof(digits) - len;
+}
+
+void                out_u64(t_output *out, uint64_t n)
+{
+    char            *str = out_reserve(out, 20);
+    size_t          len = 0;
+
+    if (!out->binary)
+        len = format_u64(str, n, 0);
+    else
+    {
+        for (; n >= 0x80 ; n >>= 7)
+            str[len++] = (n & 0x7F) | 0x80;
+        str[len++] = n;
+    }
+    out->len += len;
+}
+
+/**
+ * Varint of a bignum: its base 10^9 limbs are divided by 128 (a copy of
+ * them) until nothing is left
+ */
+static void         out_bignum_varint(t_output *out, const t_bignum *big)
+{
+    uint32_t        limbs[big->count];
+    uint64_t        cur, rem;
+    size_t          count = big->count, i;
+    char            *str;
+
+    memcpy(limbs, big->limbs, sizeof(limbs));
+    do
+    {
+        for (i = count, rem = 0 ; i-- > 0 ;)
+        {
+            cur = rem * BIGNUM_BASE + limbs[i];
+            limbs[i] = cur >> 7;
+            rem = cur & 0x7F;
+        }
+        while (count > 1 && limbs[count - 1] == 0)
+            --count;
+        str = out_reserve(out, 1);
+        *str = rem | (count > 1 || limbs[0] > 0 ? 0x80 : 0);
+        ++out->len;
+    } while (count > 1 || limbs[0] > 0);
+}
+
+void                out_bignum(t_output *out, const t_bignum *big)
+{
+    size_t          i = big->count;
+
+    if (out->binary)
+    {
+        out_bignum_varint(out, big);
+        return;
+    }
+    out->len += format_u64(out_reserve(out, 20), big->limbs[--i], 0);
+    while (i-- > 0)
+        out->len += format_u64(out_reserve(out, 20), big->limbs[i], 9);
+}
+
+/**
+ * ", " between two numbers of a decimal sequence, varints need nothing
+ */
+void                out_separator(t_output *out)
+{
+    if (out->binary)
+        return;
+    memcpy(out_reserve(out, 2), ", ", 2);
+    out->len += 2;
+}
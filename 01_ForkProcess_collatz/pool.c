@@ -0,0 +1,480 @@
+/**
+ * Process pool of a range sweep: workers are forked once, pinned to a CPU
+ * each, and fed chunks through a ring in the shared mapping. Their results
+ * come back through their slots. The supervisor reaps them, puts the chunk
+ * a dead one was on back on the ring and respawns it, so a crash only
+ * costs the work in progress.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "collatz.h"
+
+/**
+ * A chunk whose worker died: how many times it did, and whether it waits
+ * to be pushed back to the ring. Past CHUNK_RETRIES it isn't going to pass.
+ */
+#define CHUNK_RETRIES       (1)
+
+typedef struct      s_retry
+{
+    uint64_t        chunk;
+    unsigned        attempts;
+    int             queued;
+}                   t_retry;
+
+/**
+ * Supervisor side: the workers' pids (0 once reaped), the CPUs they are
+ * pinned to, the next chunk to push to the ring, and the chunks which
+ * killed a worker (`queued` of them still to push)
+ */
+typedef struct      s_pool
+{
+    pid_t           *pids;
+    int             cpus[CPU_SETSIZE];
+    unsigned        cpu_count;
+    uint64_t        next;
+    t_retry         *retries;
+    unsigned        retry_count;
+    unsigned        queued;
+}                   t_pool;
+
+/**
+ * A popped cell is claimed first: its seq becomes RING_CLAIM of its
+ * position and of the worker, so a worker killed before it released the
+ * cell is known, and the supervisor releases it (RING_POSITION bits of
+ * the position are enough to tell the laps of a cell apart)
+ */
+#define RING_CLAIMED        (1ULL << 63)
+#define RING_POSITION       ((1ULL << 40) - 1)
+#define RING_CLAIM(p, w)    (RING_CLAIMED | ((uint64_t)(w) << 40) | ((p) & RING_POSITION))
+#define RING_OWNER(seq)     ((unsigned)(((seq) & ~RING_CLAIMED) >> 40))
+
+static volatile sig_atomic_t    interrupted = 0;
+
+static void         on_interrupt(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+}
+
+static double       now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Push a chunk (the supervisor is the only producer), returns 0 if the
+ * ring is full
+ */
+static int          ring_push(t_ring *ring, uint64_t chunk)
+{
+    t_ring_cell     *cell = &ring->cells[ring->tail % RING_SIZE];
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != ring->tail)
+        return 0;
+    cell->chunk = chunk;
+    __atomic_store_n(&cell->seq, ring->tail + 1, __ATOMIC_RELEASE);
+    ++ring->tail;
+    return 1;
+}
+
+/**
+ * Pop a chunk for the worker of slot `index`, the workers race for the
+ * cell at the head: the winner claims it, then moves the head (or another
+ * worker finding the claim does), and publishes the chunk as its current
+ * one before releasing the cell. Returns 0 if the ring is empty.
+ */
+static int          ring_pop(t_ring *ring, t_slot *slot, unsigned index, uint64_t *chunk)
+{
+    uint64_t        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), seq, expected;
+    t_ring_cell     *cell;
+
+    for (;;)
+    {
+        cell = &ring->cells[head % RING_SIZE];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (seq == head + 1 && __atomic_compare_exchange_n(&cell->seq, &seq, RING_CLAIM(head, index), 0,
+                                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+        if ((seq & RING_CLAIMED) && (seq & RING_POSITION) == (head & RING_POSITION))
+            __atomic_compare_exchange_n(&ring->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        else if (!(seq & RING_CLAIMED) && (int64_t)(seq - (head + 1)) < 0)
+            return 0;
+        else if ((seq & RING_CLAIMED) && head == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+            return 0; /* Still held from the previous lap */
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    expected = head;
+    __atomic_compare_exchange_n(&ring->head, &expected, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    *chunk = cell->chunk;
+    __atomic_store_n(&slot->current, *chunk + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&cell->seq, head + RING_SIZE, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Supervisor side, once the worker of slot `index` is reaped: release the
+ * cells it claimed and didn't release, their chunk becoming the slot's
+ * current one (worker_left() puts it back on the ring, it isn't lost)
+ */
+static void         ring_recover(t_ring *ring, t_slot *slot, unsigned index)
+{
+    uint64_t        i, seq, position, expected;
+    t_ring_cell     *cell;
+
+    for (i = 0 ; i < RING_SIZE ; ++i)
+    {
+        cell = &ring->cells[i];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & RING_CLAIMED) || RING_OWNER(seq) != index)
+            continue;
+        /* The claimed positions are the RING_SIZE before the tail */
+        position = ring->tail - 1 - ((ring->tail - 1 - i) % RING_SIZE);
+        expected = position;
+        __atomic_compare_exchange_n(&ring->head, &expected, position + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->current, cell->chunk + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&cell->seq, position + RING_SIZE, __ATOMIC_RELEASE);
+    }
+}
+
+static void         ring_init(t_ring *ring)
+{
+    uint64_t        i;
+
+    for (i = 0 ; i < RING_SIZE ; ++i)
+        ring->cells[i].seq = i;
+}
+
+/**
+ * Next chunk of the worker, from the ring. Returns 0 once the ring is
+ * empty and closed.
+ */
+static int          claim_chunk(t_sweep *sweep, unsigned index, t_cursor *cursor, uint64_t *chunk)
+{
+    const struct timespec   nap = {0, RING_NAP};
+    int                     closed;
+
+    for (;;)
+    {
+        closed = __atomic_load_n(&sweep->ring.closed, __ATOMIC_ACQUIRE);
+        if (ring_pop(&sweep->ring, &sweep->slots[index], index, chunk))
+            break;
+        if (closed)
+            return 0;
+        nanosleep(&nap, NULL);
+    }
+    cursor->seed = sweep->lo + *chunk * sweep->chunk;
+    cursor->end = (sweep->hi - cursor->seed < sweep->chunk ? sweep->hi : cursor->seed + sweep->chunk);
+    return 1;
+}
+
+/**
+ * Add a completed chunk to the worker's slot (and mark it done), inside
+ * the odd `seq` window so the parent never copies half of it
+ */
+static void         commit_chunk(t_sweep *sweep, t_slot *slot, const t_result *result, uint64_t chunk)
+{
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    reduce(&slot->result, result);
+    if (sweep->done != NULL)
+        __atomic_fetch_or(&sweep->done[chunk / 64], 1ULL << (chunk % 64), __ATOMIC_RELAXED);
+    slot->current = 0;
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Worker process: run the kernel over one chunk at a time until the range
+ * is exhausted, the results go to the worker's own (cache line aligned)
+ * slot as each chunk completes
+ */
+static int          run_worker(t_sweep *sweep, unsigned index)
+{
+    const t_kernel  *kernel = kernel_get(sweep->kernel);
+    t_slot          *slot = &sweep->slots[index];
+    t_cursor        cursor;
+    t_result        result;
+    uint64_t        chunk;
+
+    while (claim_chunk(sweep, index, &cursor, &chunk))
+    {
+        memset(&result, 0, sizeof(result));
+        if (kernel->run(sweep, &result, &cursor) != RETURN_SUCCESS)
+            return RETURN_FAILURE;
+        commit_chunk(sweep, slot, &result, chunk);
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Fork the worker of slot `index`, pinned to the index-th CPU this
+ * process may run on (an unpinned worker still works)
+ */
+static pid_t        spawn_worker(t_sweep *sweep, t_pool *pool, unsigned index)
+{
+    cpu_set_t       set;
+    pid_t           pid;
+
+    if ((pid = fork()) == 0)
+    { /** Worker process */
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        CPU_ZERO(&set);
+        CPU_SET(pool->cpus[index % pool->cpu_count], &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == SYSCALL_ERROR)
+            perror("sched_setaffinity");
+        _exit(run_worker(sweep, index));
+    }
+    if (pid == SYSCALL_ERROR)
+    {
+        fprintf(stderr, "[-] Failed to create worker %u\n", index);
+        perror("fork");
+    }
+    else
+        sweep->slots[index].pid = pid;
+    return pid;
+}
+
+/**
+ * Push the chunks to retry, then the chunks not done yet, until the ring
+ * is full, and close it once they are all in
+ */
+static void         top_up(t_sweep *sweep, t_pool *pool)
+{
+    unsigned        i;
+
+    for (i = 0 ; pool->queued > 0 && i < pool->retry_count ; ++i)
+        if (pool->retries[i].queued)
+        {
+            if (!ring_push(&sweep->ring, pool->retries[i].chunk))
+                return;
+            pool->retries[i].queued = 0;
+            --pool->queued;
+        }
+    while (pool->next < sweep->chunks)
+    {
+        if (sweep->done != NULL && (sweep->done[pool->next / 64] >> (pool->next % 64)) & 1)
+            ++pool->next;
+        else if (ring_push(&sweep->ring, pool->next))
+            ++pool->next;
+        else
+            return;
+    }
+    __atomic_store_n(&sweep->ring.closed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Throughput since the last report, from the chunks the workers completed
+ */
+static void         report_progress(const t_sweep *sweep, t_result *last, double interval)
+{
+    t_result        total;
+    double          rate;
+
+    sweep_snapshot(sweep, &total, NULL);
+    rate = (total.seeds - last->seeds) / interval;
+    fprintf(stderr, "[~] %.1f%% (%llu/%llu seeds), %.0f seeds/s, %.0f steps/s, ETA %.0f s\n",
+            100.0 * total.seeds / (sweep->hi - sweep->lo), (unsigned long long)total.seeds,
+            (unsigned long long)(sweep->hi - sweep->lo), rate, (total.steps - last->steps) / interval,
+            rate > 0 ? (sweep->hi - sweep->lo - total.seeds) / rate : 0.0);
+    *last = total;
+}
+
+/**
+ * Put the chunk a dead worker was on back on the ring (reopened until it
+ * is in), returns RETURN_FAILURE once it killed more than CHUNK_RETRIES
+ * workers
+ */
+static int          retry_chunk(t_sweep *sweep, t_pool *pool, uint64_t chunk)
+{
+    t_retry         *retry;
+    unsigned        i;
+
+    for (i = 0 ; i < pool->retry_count && pool->retries[i].chunk != chunk ; ++i);
+    if (i == pool->retry_count)
+    {
+        if ((retry = realloc(pool->retries, (i + 1) * sizeof(*retry))) == NULL)
+        {
+            perror("realloc");
+            return RETURN_FAILURE;
+        }
+        pool->retries = retry;
+        pool->retries[i] = (t_retry){chunk, 0, 0};
+        ++pool->retry_count;
+    }
+    retry = &pool->retries[i];
+    if (++retry->attempts > CHUNK_RETRIES)
+    {
+        fprintf(stderr, ", chunk %llu killed %u workers, giving up\n", (unsigned long long)chunk, retry->attempts);
+        return RETURN_FAILURE;
+    }
+    retry->queued = 1;
+    ++pool->queued;
+    __atomic_store_n(&sweep->ring.closed, 0, __ATOMIC_RELEASE);
+    fprintf(stderr, ", chunk %llu goes back to the ring", (unsigned long long)chunk);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * A worker left: done if it exited cleanly, else its chunk is retried (up
+ * to CHUNK_RETRIES times per chunk) and it is respawned. Returns
+ * RETURN_FAILURE if the sweep can't complete.
+ */
+static int          worker_left(t_sweep *sweep, t_pool *pool, unsigned index, int status, int stopping)
+{
+    t_slot          *slot = &sweep->slots[index];
+    uint64_t        current;
+
+    pool->pids[index] = 0;
+    ring_recover(&sweep->ring, slot, index);
+    /* Reaped, the snapshots can't tell it died in the middle of a commit any more */
+    if (slot->seq % 2 == 1)
+        __atomic_store_n(&slot->dead, 1, __ATOMIC_RELEASE);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == RETURN_SUCCESS)
+        return RETURN_SUCCESS;
+    if (stopping)
+        return RETURN_FAILURE;
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "[~] Worker %u was killed by signal %d (%s)", index, WTERMSIG(status), strsignal(WTERMSIG(status)));
+    else
+        fprintf(stderr, "[~] Worker %u failed", index);
+    if (slot->dead)
+    {
+        fprintf(stderr, ", in the middle of a commit: its results are lost\n");
+        return RETURN_FAILURE;
+    }
+    if ((current = slot->current) != 0)
+    {
+        slot->current = 0;
+        if (retry_chunk(sweep, pool, current - 1) != RETURN_SUCCESS)
+            return RETURN_FAILURE;
+    }
+    fprintf(stderr, ", respawning it\n");
+    return (pool->pids[index] = spawn_worker(sweep, pool, index)) == SYSCALL_ERROR ? RETURN_FAILURE : RETURN_SUCCESS;
+}
+
+/* SIGTERM the workers still running, their completed chunks are kept */
+static void         stop_workers(const t_sweep *sweep, const t_pool *pool)
+{
+    unsigned        i;
+
+    for (i = 0 ; i < sweep->workers ; ++i)
+        if (pool->pids[i] > 0)
+            kill(pool->pids[i], SIGTERM);
+}
+
+/**
+ * Keep the ring fed and reap the workers, meanwhile reporting the
+ * throughput every `progress` seconds and checkpointing every
+ * `checkpoint_interval` seconds, from snapshots of their slots. On
+ * SIGINT/SIGTERM, or once the sweep can't complete, the workers are
+ * stopped, the chunks they completed are kept by the last checkpoint.
+ */
+static int          supervise(t_sweep *sweep, t_pool *pool, const t_options *options, double previous, double start)
+{
+    const struct timespec   tick = {0, SUPERVISE_TICK * 1000000L};
+    double                  t, last_report = start, last_save = start;
+    t_result                last = sweep->resumed;
+    unsigned                i, alive = 0;
+    int                     status, stopping = 0, ret = RETURN_SUCCESS;
+    pid_t                   pid;
+
+    for (i = 0 ; i < sweep->workers ; ++i)
+        alive += (pool->pids[i] > 0);
+    while (alive > 0)
+    {
+        if ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (i = 0 ; pool->pids[i] != pid ; ++i);
+            if (worker_left(sweep, pool, i, status, stopping || interrupted) != RETURN_SUCCESS
+                && !stopping && !interrupted)
+            {
+                fprintf(stderr, "[~] The sweep can't complete, stopping the workers\n");
+                stop_workers(sweep, pool);
+                stopping = 1;
+                ret = RETURN_FAILURE;
+            }
+            alive -= (pool->pids[i] <= 0);
+            continue;
+        }
+        if (pid == SYSCALL_ERROR && errno != EINTR)
+        {
+            perror("waitpid");
+            return RETURN_FAILURE;
+        }
+        if (interrupted && !stopping)
+        {
+            fprintf(stderr, "[~] Interrupted, stopping the workers\n");
+            stop_workers(sweep, pool);
+            stopping = 1;
+            ret = RETURN_FAILURE;
+        }
+        top_up(sweep, pool);
+        t = now();
+        if (options->progress > 0 && t - last_report >= options->progress)
+        {
+            report_progress(sweep, &last, t - last_report);
+            last_report = t;
+        }
+        if (options->checkpoint != NULL && t - last_save >= options->checkpoint_interval)
+        {
+            checkpoint_save(sweep, options->checkpoint, previous + t - start);
+            last_save = t;
+        }
+        nanosleep(&tick, NULL);
+    }
+    return ret;
+}
+
+/**
+ * Start `sweep->workers` workers and supervise them until the range is
+ * done, `elapsed` being the time it took. A worker which fails to start
+ * leaves its share to the others.
+ */
+int                 pool_run(t_sweep *sweep, const t_options *options, double previous, double *elapsed)
+{
+    struct sigaction    action;
+    cpu_set_t           set;
+    t_pool              pool;
+    pid_t               pids[sweep->workers];
+    unsigned            i, started = 0;
+    int                 cpu, ret;
+    double              start;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.pids = pids;
+    if (sched_getaffinity(0, sizeof(set), &set) != SYSCALL_ERROR)
+        for (cpu = 0 ; cpu < CPU_SETSIZE ; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                pool.cpus[pool.cpu_count++] = cpu;
+    if (pool.cpu_count == 0)
+        pool.cpus[pool.cpu_count++] = sched_getcpu();
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_interrupt;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    ring_init(&sweep->ring);
+    top_up(sweep, &pool);
+    start = now();
+    fflush(stdout);
+    for (i = 0 ; i < sweep->workers ; ++i)
+        started += ((pids[i] = spawn_worker(sweep, &pool, i)) != SYSCALL_ERROR);
+    if (started == 0)
+        return RETURN_FAILURE;
+    ret = supervise(sweep, &pool, options, previous, start);
+    *elapsed = now() - start;
+    free(pool.retries);
+    return ret;
+}
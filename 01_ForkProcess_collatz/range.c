@@ -0,0 +1,304 @@
+/**
+ * Range mode: stopping time and peak of every seed in [lo, hi), computed
+ * by a pool of forked workers (pool.c)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "collatz.h"
+
+/**
+ * Mix the seed, its stopping time and peak into 64 bits (splitmix64 finalizer)
+ */
+static uint64_t     seed_hash(uint64_t seed, uint64_t steps, t_u128 peak)
+{
+    uint64_t        h = seed ^ (steps << 48) ^ ((uint64_t)peak * 0x9E3779B97F4A7C15ULL)
+                        ^ ((uint64_t)(peak >> 64) * 0xC2B2AE3D27D4EB4FULL);
+
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+/**
+ * Count the stopping time (or glide) and peak of `seed` in `result`
+ */
+void                record_seed(t_result *result, uint64_t seed, uint64_t steps, t_u128 peak)
+{
+    ++result->seeds;
+    result->steps += steps;
+    result->checksum += seed_hash(seed, steps, peak);
+    ++result->histogram[steps / HISTOGRAM_WIDTH < HISTOGRAM_BINS ? steps / HISTOGRAM_WIDTH : HISTOGRAM_BINS - 1];
+    if (steps > result->max_steps)
+    {
+        result->max_steps = steps;
+        result->max_steps_seed = seed;
+    }
+    if (peak > result->peak)
+    {
+        result->peak = peak;
+        result->peak_seed = seed;
+    }
+}
+
+/**
+ * Walk the sequence of `seed` down to 1 or to a cached value, no printing,
+ * from `n` which is `steps` steps in (the SIMD kernels hand over their
+ * lanes here), `peak` being the highest value so far.
+ * The walk stays in 64 bits until 3n + 1 overflows, walk_wide() carries
+ * on in 128 bits (or bignums) and hands it back once it fits again.
+ * The cache writes race with the other workers, but they all store the
+ * same values and the stopping time is published last.
+ */
+int                 walk_from(const t_sweep *sweep, t_result *result, uint64_t seed,
+                              uint64_t n, uint64_t steps, uint64_t peak)
+{
+    t_u128          wide_peak = 0;
+    uint16_t        cached = 0;
+
+    if (n != seed && n < sweep->cache_bound)
+        cached = __atomic_load_n(&sweep->cache_steps[n], __ATOMIC_ACQUIRE);
+    while (cached == 0)
+    {
+        COLLATZ_LOOP(uint64_t, n, steps, peak, n < sweep->cache_bound
+                     && (cached = __atomic_load_n(&sweep->cache_steps[n], __ATOMIC_ACQUIRE)) != 0);
+        if (n == 1 || cached != 0)
+            break;
+        if ((n = walk_wide(n, &steps, &wide_peak)) == 0)
+            return RETURN_FAILURE;
+    }
+    result->walked += steps;
+    if (cached != 0)
+    {
+        ++result->hits;
+        steps += cached;
+        peak = (sweep->cache_peaks[n] > peak ? sweep->cache_peaks[n] : peak);
+    }
+    wide_peak = (wide_peak > peak ? wide_peak : peak);
+    if (seed < sweep->cache_bound && steps <= UINT16_MAX && (wide_peak >> 64) == 0)
+    {
+        sweep->cache_peaks[seed] = peak;
+        __atomic_store_n(&sweep->cache_steps[seed], steps, __ATOMIC_RELEASE);
+    }
+    record_seed(result, seed, steps, wide_peak);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Give the next seed of the chunk, returns 0 once it is used up
+ */
+int                 next_seed(t_cursor *cursor, uint64_t *seed)
+{
+    if (cursor->seed == cursor->end)
+        return 0;
+    *seed = cursor->seed++;
+    return 1;
+}
+
+/**
+ * One seed at a time
+ */
+int                 kernel_scalar(t_sweep *sweep, t_result *result, t_cursor *cursor)
+{
+    uint64_t        seed;
+
+    while (next_seed(cursor, &seed))
+        if (walk_from(sweep, result, seed, seed, 0, seed) != RETURN_SUCCESS)
+            return RETURN_FAILURE;
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Add `from` into `to`, the seed of a maximum is the smallest one
+ * reaching it so the result doesn't depend on the scheduling
+ */
+void                reduce(t_result *to, const t_result *from)
+{
+    unsigned        i;
+
+    to->seeds += from->seeds;
+    to->steps += from->steps;
+    to->checksum += from->checksum;
+    to->walked += from->walked;
+    to->hits += from->hits;
+    to->pruned += from->pruned;
+    for (i = 0 ; i < HISTOGRAM_BINS ; ++i)
+        to->histogram[i] += from->histogram[i];
+    if (from->max_steps > to->max_steps || (from->max_steps == to->max_steps && from->max_steps_seed < to->max_steps_seed))
+    {
+        to->max_steps = from->max_steps;
+        to->max_steps_seed = from->max_steps_seed;
+    }
+    if (from->peak > to->peak || (from->peak == to->peak && from->peak_seed < to->peak_seed))
+    {
+        to->peak = from->peak;
+        to->peak_seed = from->peak_seed;
+    }
+}
+
+static void         print_result(const t_sweep *sweep, const t_result *total, double elapsed)
+{
+    unsigned        i;
+
+    printf("[+] Range [%llu, %llu): %llu seeds, %u workers, chunk %llu, kernel %s, %.3f s (%.0f seeds/s, %.0f steps/s)\n",
+           (unsigned long long)sweep->lo, (unsigned long long)sweep->hi, (unsigned long long)total->seeds,
+           sweep->workers, (unsigned long long)sweep->chunk, kernel_get(sweep->kernel)->name, elapsed,
+           (total->seeds - sweep->resumed.seeds) / (elapsed + 1e-9),
+           (total->steps - sweep->resumed.steps) / (elapsed + 1e-9));
+    if (sweep->resumed.seeds > 0)
+        printf("[+] Resumed: %llu seeds were done before this run\n", (unsigned long long)sweep->resumed.seeds);
+    if (sweep->kernel == KERNEL_JUMP)
+        printf("[+] Jump tables: %u bits (%.1f KiB), %llu of %llu residues pruned by the sieve\n",
+               sweep->jump.bits, (sizeof(*sweep->jump.entries) << sweep->jump.bits) / 1024.0,
+               (unsigned long long)sweep->jump.pruned, (unsigned long long)sweep->jump.mask + 1);
+    if (sweep->verify)
+    {
+        printf("[+] Verified: every seed drops below itself, %llu sieved out (%.1f%%)\n",
+               (unsigned long long)total->pruned, 100.0 * total->pruned / (total->seeds + 1e-9));
+        printf("[+] Max glide: %llu (seed %llu)\n",
+               (unsigned long long)total->max_steps, (unsigned long long)total->max_steps_seed);
+    }
+    else
+    {
+        printf("[+] Max stopping time: %llu (seed %llu)\n",
+               (unsigned long long)total->max_steps, (unsigned long long)total->max_steps_seed);
+        printf("[+] Max peak: ");
+        print_u128(total->peak);
+        printf("%s (seed %llu)\n", total->peak == ~(t_u128)0 ? "+" : "", (unsigned long long)total->peak_seed);
+    }
+    printf("[+] Checksum: %016llx\n", (unsigned long long)total->checksum);
+    if (sweep->cache_bound > 0)
+        printf("[+] Cache: %llu seeds (%.1f MiB), hit rate %.1f%%, walked %llu of %llu steps (%.1f%%)\n",
+               (unsigned long long)sweep->cache_bound,
+               sweep->cache_bound * (sizeof(*sweep->cache_steps) + sizeof(*sweep->cache_peaks)) / 1048576.0,
+               100.0 * total->hits / (total->seeds + 1e-9), (unsigned long long)total->walked,
+               (unsigned long long)total->steps, 100.0 * total->walked / (total->steps + 1e-9));
+    printf("[+] %s histogram:\n", sweep->verify ? "Glide" : "Stopping time");
+    for (i = 0 ; i < HISTOGRAM_BINS ; ++i)
+        if (total->histogram[i] > 0)
+            printf("    [%4u, %4u%s %llu\n", i * HISTOGRAM_WIDTH, (i + 1) * HISTOGRAM_WIDTH,
+                   i + 1 < HISTOGRAM_BINS ? ") " : "+)", (unsigned long long)total->histogram[i]);
+}
+
+/**
+ * Map the shared cache of the seeds below `bound`, pages are only touched
+ * (and zeroed) by the kernel when the workers reach them
+ */
+static int          cache_map(t_sweep *sweep, uint64_t bound)
+{
+    sweep->cache_bound = bound;
+    if (bound == 0)
+        return RETURN_SUCCESS;
+    sweep->cache_steps = mmap(NULL, bound * sizeof(*sweep->cache_steps), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    sweep->cache_peaks = mmap(NULL, bound * sizeof(*sweep->cache_peaks), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sweep->cache_steps != MAP_FAILED && sweep->cache_peaks != MAP_FAILED)
+        return RETURN_SUCCESS;
+    fprintf(stderr, "[-] Failed to map a cache of %llu seeds\n", (unsigned long long)bound);
+    perror("mmap");
+    if (sweep->cache_steps != MAP_FAILED)
+        munmap(sweep->cache_steps, bound * sizeof(*sweep->cache_steps));
+    if (sweep->cache_peaks != MAP_FAILED)
+        munmap(sweep->cache_peaks, bound * sizeof(*sweep->cache_peaks));
+    sweep->cache_bound = 0;
+    return RETURN_FAILURE;
+}
+
+static void         cache_unmap(t_sweep *sweep)
+{
+    if (sweep->cache_bound == 0)
+        return;
+    munmap(sweep->cache_steps, sweep->cache_bound * sizeof(*sweep->cache_steps));
+    munmap(sweep->cache_peaks, sweep->cache_bound * sizeof(*sweep->cache_peaks));
+}
+
+/**
+ * Map the bitmap of the completed chunks, only kept when checkpointing
+ */
+static int          done_map(t_sweep *sweep)
+{
+    sweep->done = mmap(NULL, (sweep->chunks + 63) / 64 * sizeof(*sweep->done), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sweep->done != MAP_FAILED)
+        return RETURN_SUCCESS;
+    perror("mmap");
+    sweep->done = NULL;
+    return RETURN_FAILURE;
+}
+
+/**
+ * Release what sweep_range() set up, whatever step it stopped at
+ */
+static void         sweep_release(t_sweep *sweep, size_t size)
+{
+    cache_unmap(sweep);
+    jump_free(&sweep->jump);
+    if (sweep->done != NULL)
+        munmap(sweep->done, (sweep->chunks + 63) / 64 * sizeof(*sweep->done));
+    munmap(sweep, size);
+}
+
+/**
+ * Seeds below the bound have their stopping time cached: none past `hi`,
+ * and no cache at all if it holds no seed of the range (nothing would
+ * ever be stored for the lookups to hit)
+ */
+static uint64_t     cache_bound(uint64_t lo, uint64_t hi, const t_options *options)
+{
+    uint64_t        bound = (options->cache < hi ? options->cache : hi);
+
+    return (options->verify || lo >= bound ? 0 : bound);
+}
+
+/**
+ * Sweep [lo, hi) with a pool of `workers` processes handed `chunk` seeds
+ * at a time, then reduce their results. The seeds
+ * below `cache` share their stopping times. The jump tables are built
+ * before the fork, the workers read the parent's copy. With a checkpoint
+ * file, the chunks it marks as done are skipped and it is kept up to date.
+ */
+int                 sweep_range(uint64_t lo, uint64_t hi, const t_options *options)
+{
+    t_sweep         *sweep;
+    t_result        total;
+    size_t          size = sizeof(*sweep) + options->workers * sizeof(t_slot);
+    int             ret;
+    double          elapsed = 0, previous = 0;
+
+    if ((sweep = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        perror("mmap");
+        return RETURN_FAILURE;
+    }
+    sweep->lo = lo;
+    sweep->hi = hi;
+    sweep->chunk = options->chunk;
+    sweep->chunks = (hi - lo - 1) / options->chunk + 1;
+    sweep->workers = options->workers;
+    /** Verifying only needs the glides, which the jump kernel computes */
+    sweep->verify = options->verify;
+    sweep->kernel = (options->verify ? KERNEL_JUMP : options->kernel);
+    if ((sweep->kernel == KERNEL_JUMP && jump_init(&sweep->jump, options->jump_bits) != RETURN_SUCCESS)
+        || (options->checkpoint != NULL && (done_map(sweep) != RETURN_SUCCESS
+                                            || checkpoint_load(sweep, options->checkpoint, &previous) != RETURN_SUCCESS))
+        || cache_map(sweep, cache_bound(lo, hi, options)) != RETURN_SUCCESS)
+    {
+        sweep_release(sweep, size);
+        return RETURN_FAILURE;
+    }
+    ret = pool_run(sweep, options, previous, &elapsed);
+    if (options->checkpoint != NULL && checkpoint_save(sweep, options->checkpoint, previous + elapsed) != RETURN_SUCCESS)
+        ret = RETURN_FAILURE;
+    sweep_snapshot(sweep, &total, NULL);
+    if (ret != RETURN_SUCCESS || total.seeds != hi - lo)
+    {
+        fprintf(stderr, "[-] Sweep incomplete: %llu/%llu seeds\n",
+                (unsigned long long)total.seeds, (unsigned long long)(hi - lo));
+        ret = RETURN_FAILURE;
+    }
+    else
+        print_result(sweep, &total, elapsed);
+    sweep_release(sweep, size);
+    return ret;
+}
@@ -0,0 +1,200 @@
+/**
+ * SIMD range kernels: several seeds are walked at once, one per 64 bits
+ * lane, odd and even steps are both computed and blended. A lane which
+ * reaches 1, drops below its seed into the cache (where walk_from() finds
+ * its stopping time) or would overflow is handed over to walk_from() and
+ * refilled with the next seed.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <immintrin.h>
+#include "collatz.h"
+
+static const t_kernel   kernels[KERNEL_COUNT] =
+{
+    [KERNEL_AUTO] = {"auto", NULL, NULL},
+    [KERNEL_SCALAR] = {"scalar", kernel_scalar, NULL},
+    [KERNEL_AVX2] = {"avx2", kernel_avx2, "avx2"},
+    [KERNEL_AVX512] = {"avx512", kernel_avx512, "avx512cd"},
+    [KERNEL_JUMP] = {"jump", kernel_jump, NULL},
+};
+
+const t_kernel          *kernel_get(t_kernel_id id)
+{
+    return &kernels[id];
+}
+
+static int              kernel_supported(t_kernel_id id)
+{
+    __builtin_cpu_init();
+    if (id == KERNEL_AVX2)
+        return __builtin_cpu_supports("avx2");
+    if (id == KERNEL_AVX512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd");
+    return id == KERNEL_SCALAR || id == KERNEL_JUMP;
+}
+
+/**
+ * Returns the kernel matching `name` (the widest the CPU runs for "auto",
+ * the next narrower one if it can't run the requested one), or
+ * KERNEL_COUNT if there is none
+ */
+t_kernel_id             kernel_from_name(const char *name)
+{
+    t_kernel_id         id;
+
+    for (id = KERNEL_AUTO ; id < KERNEL_COUNT ; ++id)
+        if (strcmp(kernels[id].name, name) == 0)
+            break;
+    if (id == KERNEL_COUNT)
+        return id;
+    if (id == KERNEL_AUTO)
+        id = KERNEL_AVX512;
+    else if (!kernel_supported(id))
+        fprintf(stderr, "[~] This CPU has no %s, falling back to a narrower kernel\n", kernels[id].cpu_feature);
+    while (!kernel_supported(id))
+        --id;
+    return id;
+}
+
+/**
+ * Hand the lanes set in `done` over to walk_from(), and refill them.
+ * Lanes without a seed left are removed from `active`. Returns
+ * RETURN_FAILURE if a walk failed.
+ */
+static int              retire_lanes(t_sweep *sweep, t_result *result, t_cursor *cursor, unsigned done,
+                                     unsigned *active, uint64_t *seeds, uint64_t *ns, uint64_t *steps, uint64_t *peaks)
+{
+    unsigned            i;
+
+    for (i = 0 ; done != 0 ; ++i, done >>= 1)
+    {
+        if (!(done & 1))
+            continue;
+        /* Seed 0 is an empty lane, before the first fill */
+        if (seeds[i] != 0 && walk_from(sweep, result, seeds[i], ns[i], steps[i], peaks[i]) != RETURN_SUCCESS)
+            return RETURN_FAILURE;
+        steps[i] = 0;
+        if (next_seed(cursor, &seeds[i]))
+            ns[i] = peaks[i] = seeds[i];
+        else
+        {
+            *active &= ~(1U << i);
+            ns[i] = peaks[i] = 1;
+        }
+    }
+    return RETURN_SUCCESS;
+}
+
+/**
+ * AVX2 has no 64 bits lane compare for unsigned numbers, flip the sign bit
+ */
+__attribute__((target("avx2")))
+static inline __m256i   cmpgt_epu64(__m256i a, __m256i b)
+{
+    const __m256i       sign = _mm256_set1_epi64x((long long)(1ULL << 63));
+
+    return _mm256_cmpgt_epi64(_mm256_xor_si256(a, sign), _mm256_xor_si256(b, sign));
+}
+
+/**
+ * 4 lanes, with the (3n + 1) / 2 shortcut: one blended step per round
+ * (AVX2 has no lane lzcnt for the trailing zeros jump)
+ */
+__attribute__((target("avx2")))
+int                     kernel_avx2(t_sweep *sweep, t_result *result, t_cursor *cursor)
+{
+    uint64_t            seeds[4] __attribute__((aligned(32))) = {0}, ns[4] __attribute__((aligned(32)));
+    uint64_t            steps[4] __attribute__((aligned(32))), peaks[4] __attribute__((aligned(32)));
+    const __m256i       one = _mm256_set1_epi64x(1);
+    const __m256i       limit = _mm256_set1_epi64x(COLLATZ_LIMIT(uint64_t));
+    const __m256i       cache_bound = _mm256_set1_epi64x(sweep->cache_bound);
+    __m256i             n, bound, step, peak, odd, up, tripled;
+    unsigned            active = 0xF, done = active;
+    int                 cache = (sweep->cache_bound > 0);
+
+    memset(steps, 0, sizeof(steps));
+    for (;;)
+    {
+        if (done != 0)
+        {
+            if (retire_lanes(sweep, result, cursor, done, &active, seeds, ns, steps, peaks) != RETURN_SUCCESS)
+                return RETURN_FAILURE;
+            if (active == 0)
+                return RETURN_SUCCESS;
+            n = _mm256_load_si256((const __m256i *)ns);
+            /* min(seed, cache_bound): below it a lane can be finished from the cache */
+            bound = _mm256_load_si256((const __m256i *)seeds);
+            bound = _mm256_blendv_epi8(bound, cache_bound, cmpgt_epu64(bound, cache_bound));
+            step = _mm256_load_si256((const __m256i *)steps);
+            peak = _mm256_load_si256((const __m256i *)peaks);
+        }
+        odd = _mm256_cmpeq_epi64(_mm256_and_si256(n, one), one);
+        up = _mm256_or_si256(_mm256_cmpeq_epi64(n, one), _mm256_and_si256(odd, cmpgt_epu64(n, limit)));
+        if (cache)
+            up = _mm256_or_si256(up, cmpgt_epu64(bound, n));
+        if ((done = _mm256_movemask_pd(_mm256_castsi256_pd(up)) & active) != 0)
+        {
+            _mm256_store_si256((__m256i *)ns, n);
+            _mm256_store_si256((__m256i *)steps, step);
+            _mm256_store_si256((__m256i *)peaks, peak);
+            continue;
+        }
+        /* odd: 3n + 1 then halved, 2 steps. even: halved, 1 step */
+        tripled = _mm256_add_epi64(_mm256_add_epi64(n, _mm256_add_epi64(n, n)), one);
+        peak = _mm256_blendv_epi8(peak, tripled, _mm256_and_si256(odd, cmpgt_epu64(tripled, peak)));
+        n = _mm256_srli_epi64(_mm256_blendv_epi8(n, tripled, odd), 1);
+        step = _mm256_add_epi64(step, _mm256_sub_epi64(one, odd));
+    }
+}
+
+/**
+ * 8 lanes: an odd lane takes 3n + 1, then every lane drops all its
+ * trailing zeros at once (63 - lzcnt(n & -n), AVX-512CD)
+ */
+__attribute__((target("avx512f,avx512cd")))
+int                     kernel_avx512(t_sweep *sweep, t_result *result, t_cursor *cursor)
+{
+    uint64_t            seeds[8] __attribute__((aligned(64))) = {0}, ns[8] __attribute__((aligned(64)));
+    uint64_t            steps[8] __attribute__((aligned(64))), peaks[8] __attribute__((aligned(64)));
+    const __m512i       one = _mm512_set1_epi64(1), top = _mm512_set1_epi64(63);
+    const __m512i       limit = _mm512_set1_epi64(COLLATZ_LIMIT(uint64_t));
+    const __m512i       cache_bound = _mm512_set1_epi64(sweep->cache_bound);
+    __m512i             n, bound, step, peak, tz;
+    __mmask8            odd, up;
+    unsigned            active = 0xFF, done = active;
+    int                 cache = (sweep->cache_bound > 0);
+
+    memset(steps, 0, sizeof(steps));
+    for (;;)
+    {
+        if (done != 0)
+        {
+            if (retire_lanes(sweep, result, cursor, done, &active, seeds, ns, steps, peaks) != RETURN_SUCCESS)
+                return RETURN_FAILURE;
+            if (active == 0)
+                return RETURN_SUCCESS;
+            n = _mm512_load_si512(ns);
+            bound = _mm512_min_epu64(_mm512_load_si512(seeds), cache_bound);
+            step = _mm512_load_si512(steps);
+            peak = _mm512_load_si512(peaks);
+        }
+        odd = _mm512_test_epi64_mask(n, one);
+        up = _mm512_cmpeq_epu64_mask(n, one) | (odd & _mm512_cmpgt_epu64_mask(n, limit));
+        if (cache)
+            up |= _mm512_cmplt_epu64_mask(n, bound);
+        if ((done = up & active) != 0)
+        {
+            _mm512_store_si512(ns, n);
+            _mm512_store_si512(steps, step);
+            _mm512_store_si512(peaks, peak);
+            continue;
+        }
+        n = _mm512_mask_add_epi64(n, odd, _mm512_add_epi64(n, _mm512_add_epi64(n, n)), one);
+        step = _mm512_mask_add_epi64(step, odd, step, one);
+        peak = _mm512_max_epu64(peak, n);
+        tz = _mm512_sub_epi64(top, _mm512_lzcnt_epi64(_mm512_and_si512(n, _mm512_sub_epi64(_mm512_setzero_si512(), n))));
+        n = _mm512_srlv_epi64(n, tz);
+        step = _mm512_add_epi64(step, tz);
+    }
+}
@@ -0,0 +1,184 @@
+/**
+ * Wide arithmetic: the unsigned __int128 rung of the ladder, and the
+ * arbitrary precision numbers used past 128 bits (and to print them)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collatz.h"
+
+/**
+ * Make room for `count` limbs, returns RETURN_FAILURE if out of memory
+ */
+static int          bignum_reserve(t_bignum *big, size_t count)
+{
+    uint32_t        *limbs;
+
+    if (count <= big->size)
+        return RETURN_SUCCESS;
+    if ((limbs = realloc(big->limbs, count * 2 * sizeof(*limbs))) == NULL)
+    {
+        perror("realloc");
+        return RETURN_FAILURE;
+    }
+    big->limbs = limbs;
+    big->size = count * 2;
+    return RETURN_SUCCESS;
+}
+
+void                bignum_free(t_bignum *big)
+{
+    free(big->limbs);
+    memset(big, 0, sizeof(*big));
+}
+
+int                 bignum_from_u128(t_bignum *big, t_u128 value)
+{
+    if (bignum_reserve(big, 5) != RETURN_SUCCESS)
+        return RETURN_FAILURE;
+    big->count = 0;
+    do
+    {
+        big->limbs[big->count++] = value % BIGNUM_BASE;
+        value /= BIGNUM_BASE;
+    } while (value > 0);
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Parse a decimal number, returns RETURN_FAILURE if `str` isn't one
+ */
+int                 bignum_parse(t_bignum *big, const char *str)
+{
+    size_t          len = strlen(str), i, digits;
+
+    if (len == 0 || strspn(str, "0123456789") != len || bignum_reserve(big, len / 9 + 1) != RETURN_SUCCESS)
+        return RETURN_FAILURE;
+    for (big->count = 0 ; len > 0 ; len -= digits)
+    {
+        digits = (len < 9 ? len : 9);
+        big->limbs[big->count] = 0;
+        for (i = len - digits ; i < len ; ++i)
+            big->limbs[big->count] = big->limbs[big->count] * 10 + (str[i] - '0');
+        ++big->count;
+    }
+    while (big->count > 1 && big->limbs[big->count - 1] == 0)
+        --big->count;
+    return RETURN_SUCCESS;
+}
+
+/**
+ * Convert to 128 bits, returns 0 if `big` doesn't fit
+ */
+int                 bignum_to_u128(const t_bignum *big, t_u128 *value)
+{
+    t_u128          n = 0;
+    size_t          i;
+
+    for (i = big->count ; i-- > 0 ;)
+    {
+        if (n > (~(t_u128)0 - big->limbs[i]) / BIGNUM_BASE)
+            return 0;
+        n = n * BIGNUM_BASE + big->limbs[i];
+    }
+    *value = n;
+    return 1;
+}
+
+int                 bignum_is_one(const t_bignum *big)
+{
+    return big->count == 1 && big->limbs[0] == 1;
+}
+
+/**
+ * One Collatz step (the base is even, so is the value when the low limb is)
+ */
+int                 bignum_step(t_bignum *big)
+{
+    uint64_t        cur, carry = 1;
+    size_t          i;
+
+    if (!ODD(big->limbs[0]))
+    {
+        for (i = big->count, carry = 0 ; i-- > 0 ;)
+        {
+            cur = carry * BIGNUM_BASE + big->limbs[i];
+            big->limbs[i] = cur / 2;
+            carry = cur % 2;
+        }
+        if (big->count > 1 && big->limbs[big->count - 1] == 0)
+            --big->count;
+        return RETURN_SUCCESS;
+    }
+    if (bignum_reserve(big, big->count + 1) != RETURN_SUCCESS)
+        return RETURN_FAILURE;
+    for (i = 0 ; i < big->count ; ++i)
+    {
+        cur = 3ULL * big->limbs[i] + carry;
+        big->limbs[i] = cur % BIGNUM_BASE;
+        carry = cur / BIGNUM_BASE;
+    }
+    if (carry > 0)
+        big->limbs[big->count++] = carry;
+    return RETURN_SUCCESS;
+}
+
+void                bignum_print(const t_bignum *big)
+{
+    size_t          i = big->count;
+
+    printf("%u", big->limbs[--i]);
+    while (i-- > 0)
+        printf("%09u", big->limbs[i]);
+}
+
+/**
+ * Print a 128 bits value in decimal
+ */
+void                print_u128(t_u128 value)
+{
+    t_bignum        big = {0};
+
+    if (bignum_from_u128(&big, value) == RETURN_SUCCESS)
+        bignum_print(&big);
+    bignum_free(&big);
+}
+
+/**
+ * Bignum rung: step `*n` (odd, too big for 128 bits after 3n + 1) until
+ * it fits in 128 bits again. The peak doesn't fit, it saturates.
+ */
+static int          walk_bignum(t_u128 *n, uint64_t *steps, t_u128 *peak)
+{
+    t_bignum        big = {0};
+    int             ret = bignum_from_u128(&big, *n);
+
+    *peak = ~(t_u128)0;
+    do
+    {
+        ret |= bignum_step(&big);
+        ++*steps;
+    } while (ret == RETURN_SUCCESS && !bignum_to_u128(&big, n));
+    bignum_free(&big);
+    return ret;
+}
+
+/**
+ * 128 bits rung, called when 3n + 1 overflows 64 bits for the odd `value`:
+ * step until the value fits in 64 bits again and return it, promoting to
+ * bignums if 3n + 1 overflows 128 bits as well. Returns 0 on failure.
+ */
+uint64_t            walk_wide(uint64_t value, uint64_t *steps, t_u128 *peak)
+{
+    t_u128          n = 3 * (t_u128)value + 1;
+
+    ++*steps;
+    *peak = (n > *peak ? n : *peak);
+    while ((n >> 64) != 0)
+    {
+        COLLATZ_LOOP(t_u128, n, *steps, *peak, (n >> 64) == 0);
+        if ((n >> 64) != 0 && walk_bignum(&n, steps, peak) != RETURN_SUCCESS)
+            return 0;
+    }
+    return n;
+}
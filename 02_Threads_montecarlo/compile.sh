@@ -0,0 +1,64 @@
+#!/bin/bash
+# Compilation script
+#
+#   ./compile.sh            build mcarlo (the thread count is ./mcarlo --threads n)
+#   ./compile.sh bench      points/s for each thread count of BENCH_THREADS
+#                           (BENCH_ARGS="--kernel scalar" to compare kernels)
+#   ./compile.sh precision  time to BENCH_EPSILON for each --estimator
+
+
+build()
+{
+    gcc *.c -o "${1:-mcarlo}" -O2 -Wall -Wextra -pthread -lm
+    rm -rf *.o
+}
+
+# Each thread count run on BENCH_POINTS points BENCH_RUNS times, as CSV
+bench()
+{
+    local threads run line bin="./mcarlo.bench.$$"
+
+    trap "rm -f '$bin'" EXIT
+    build "$bin" || exit 1
+    echo "threads,run,points,seconds,points_per_s"
+    for threads in ${BENCH_THREADS:-1 2 4 $(nproc)}
+    do
+        for (( run = 0 ; run < ${BENCH_RUNS:-3} ; ++run ))
+        do
+            line=$("$bin" --threads "$threads" ${BENCH_ARGS} "${BENCH_POINTS:-100000000}" | grep '^\[+\] All Threads finished') \
+                || { echo "[-] $threads threads failed" >&2; continue; }
+            sed -E "s/.* ([0-9]+)\/([0-9]+) PI = .* \(([0-9.]+) s, ([0-9]+) points\/s\)/$threads,$run,\2,\3,\4/" <<< "$line"
+        done
+    done
+}
+
+# Points and seconds each estimator takes for its error bound to get under
+# BENCH_EPSILON, as CSV
+precision()
+{
+    local estimator run line bin="./mcarlo.bench.$$" epsilon="${BENCH_EPSILON:-1e-4}"
+    # mcarlo prints its result even when it didn't converge, its status says so
+    local -
+    set -o pipefail
+
+    trap "rm -f '$bin'" EXIT
+    build "$bin" || exit 1
+    echo "estimator,run,epsilon,points,seconds,pi,error"
+    for estimator in ${BENCH_ESTIMATORS:-plain antithetic stratified sobol halton}
+    do
+        for (( run = 0 ; run < ${BENCH_RUNS:-3} ; ++run ))
+        do
+            line=$("$bin" --report 0 --estimator "$estimator" --epsilon "$epsilon" ${BENCH_ARGS} 1099511627776 \
+                   | grep '^\[+\] All Threads finished') \
+                || { echo "[-] $estimator did not converge" >&2; continue; }
+            sed -E "s/.* ([0-9]+)\/([0-9]+) PI = ([0-9.]+) \+\/- ([0-9.e+-]+) \(([0-9.]+) s, .*/$estimator,$run,$epsilon,\2,\5,\3,\4/" <<< "$line"
+        done
+    done
+}
+
+case "${1:-build}" in
+    build)  build ;;
+    bench)  bench ;;
+    precision)  precision ;;
+    *)      echo "usage: $0 [build|bench|precision]" >&2; exit 1 ;;
+esac
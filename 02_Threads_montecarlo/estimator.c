@@ -0,0 +1,376 @@
+/**
+ * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
+ *
+ * Estimators: how the points of a chunk are laid out. Each chunk is drawn
+ * from its own stream (or randomized from it for the quasi random ones),
+ * so the chunks are independent estimates of PI and their spread gives
+ * the error bound of any of them. The variance reduced ones test the
+ * quarter circle over [0, 1)^2, which holds the same PI / 4 of it.
+ */
+#include <math.h>
+#include <string.h>
+#include <sched.h>
+#include "mcarlo.h"
+
+static double                   plain_chunk(const t_mcarlo *mcarlo, t_prng *prng, size_t count, double *points)
+{
+  unsigned long long            within = 0;
+  size_t                        done, batch;
+
+  if (mcarlo->kernel->draw != NULL && prng_is_xoshiro(mcarlo->prng))
+    return mcarlo->kernel->draw(prng, count);
+  for (done = 0 ; done < count ; done += batch)
+  {
+    /* Creating a batch of random values (x, y coordinates), whole vectors of them */
+    batch = (count - done < BATCH_SIZE ? count - done : BATCH_SIZE);
+    mcarlo->prng->fill(prng, points, 2 * POINT_ROUND(batch));
+    within += mcarlo->kernel->count(points, batch);
+  }
+  return within;
+}
+
+/**
+ * Antithetic variates: every (u, v) drawn also counts as (1 - u, 1 - v),
+ * the two tests being negatively correlated. The kernel tests both on the
+ * same vectors, fused with the draw like plain_chunk() with xoshiro.
+ */
+static double                   antithetic_chunk(const t_mcarlo *mcarlo, t_prng *prng, size_t count, double *points)
+{
+  unsigned long long            within = 0;
+  size_t                        pairs = count / 2, done, batch;
+
+  if (mcarlo->kernel->draw_antithetic != NULL && prng_is_xoshiro(mcarlo->prng))
+    within = mcarlo->kernel->draw_antithetic(prng, pairs);
+  else
+    for (done = 0 ; done < pairs ; done += batch)
+    {
+      batch = (pairs - done < BATCH_SIZE ? pairs - done : BATCH_SIZE);
+      mcarlo->prng->fill(prng, points, 2 * POINT_ROUND(batch));
+      within += mcarlo->kernel->count_antithetic(points, batch);
+    }
+  /* An odd chunk has one point without its twin */
+  if (count % 2 == 1)
+  {
+    mcarlo->prng->fill(prng, points, 2 * POINT_LANES);
+    within += mcarlo->kernel->count(points, 1);
+  }
+  return within;
+}
+
+/**
+ * Stratified: one point drawn in each cell of the STRATA x STRATA grid
+ * over [0, 1)^2 (whole chunks only)
+ */
+_Static_assert(CHUNK_SIZE == STRATA * STRATA && CHUNK_SIZE % BATCH_SIZE == 0, "a chunk is one point per cell");
+
+static double                   stratified_chunk(const t_mcarlo *mcarlo, t_prng *prng, size_t count, double *points)
+{
+  unsigned long long            within = 0;
+  size_t                        cell, i;
+
+  for (cell = 0 ; cell < count ; cell += BATCH_SIZE)
+  {
+    mcarlo->prng->fill(prng, points, 2 * BATCH_SIZE);
+    for (i = 0 ; i < BATCH_SIZE ; ++i)
+    {
+      POINT_X(points, i) = ((cell + i) % STRATA + UNIT(POINT_X(points, i))) / STRATA;
+      POINT_Y(points, i) = ((cell + i) / STRATA + UNIT(POINT_Y(points, i))) / STRATA;
+    }
+    within += mcarlo->kernel->count(points, BATCH_SIZE);
+  }
+  return within;
+}
+
+/**
+ * Sobol: the first CHUNK_SIZE points of the 2D sequence (a (0, 16, 2)-net),
+ * in gray code order, XORed with a random digital shift per chunk (whole
+ * chunks only). Dimension 1 is van der Corput, dimension 2 has the
+ * primitive polynomial x + 1: m_k = 2 m_(k-1) ^ m_(k-1), m_1 = 1.
+ */
+static double                   sobol_chunk(const t_mcarlo *mcarlo, t_prng *prng, size_t count, double *points)
+{
+  unsigned long long            within = 0;
+  uint32_t                      v1[32], v2[32], x1 = 0, x2 = 0, m = 1, shift1, shift2;
+  size_t                        n, i;
+  int                           k;
+
+  for (k = 0 ; k < 32 ; ++k, m ^= m << 1)
+  {
+    v1[k] = 1U << (31 - k);
+    v2[k] = m << (31 - k);
+  }
+  mcarlo->prng->fill(prng, points, 2 * POINT_LANES);
+  shift1 = (uint32_t)(UNIT(points[0]) * 0x1.0p32);
+  shift2 = (uint32_t)(UNIT(points[POINT_LANES]) * 0x1.0p32);
+  for (n = 0 ; n < count ; n += BATCH_SIZE)
+  {
+    for (i = 0 ; i < BATCH_SIZE ; ++i)
+    {
+      POINT_X(points, i) = (x1 ^ shift1) * 0x1.0p-32;
+      POINT_Y(points, i) = (x2 ^ shift2) * 0x1.0p-32;
+      k = __builtin_ctzll(~(unsigned long long)(n + i));
+      x1 ^= v1[k];
+      x2 ^= v2[k];
+    }
+    within += mcarlo->kernel->count(points, BATCH_SIZE);
+  }
+  return within;
+}
+
+/* Van der Corput of n in `base` */
+static double                   radical_inverse(uint64_t n, unsigned base)
+{
+  double                        inverse = 0.0, digit = 1.0 / base;
+
+  for (; n > 0 ; n /= base, digit /= base)
+    inverse += (n % base) * digit;
+  return inverse;
+}
+
+/**
+ * Van der Corput of the low HALTON_DIGITS digits, in bases 2 and 3: the
+ * indices of a chunk have twice as many at most (CHUNK_SIZE <= 256^2)
+ */
+#define HALTON_DIGITS           (8)
+#define HALTON_2                (1 << HALTON_DIGITS)
+#define HALTON_3                (6561)
+
+static double                   halton_2[HALTON_2], halton_3[HALTON_3];
+static pthread_once_t           halton_once = PTHREAD_ONCE_INIT;
+
+static void                     halton_init(void)
+{
+  unsigned                      n;
+
+  for (n = 0 ; n < HALTON_2 ; ++n)
+    halton_2[n] = radical_inverse(n, 2);
+  for (n = 0 ; n < HALTON_3 ; ++n)
+    halton_3[n] = radical_inverse(n, 3);
+}
+
+/**
+ * Halton: the first CHUNK_SIZE points of the bases 2 and 3 sequence, moved
+ * by a random rotation (u + shift mod 1) per chunk (whole chunks only)
+ */
+static double                   halton_chunk(const t_mcarlo *mcarlo, t_prng *prng, size_t count, double *points)
+{
+  unsigned long long            within = 0;
+  double                        shift1, shift2, u;
+  size_t                        n, i;
+
+  pthread_once(&halton_once, halton_init);
+  mcarlo->prng->fill(prng, points, 2 * POINT_LANES);
+  shift1 = UNIT(points[0]);
+  shift2 = UNIT(points[POINT_LANES]);
+  for (n = 0 ; n < count ; n += BATCH_SIZE)
+  {
+    for (i = 0 ; i < BATCH_SIZE ; ++i)
+    {
+      u = halton_2[(n + i) % HALTON_2] + halton_2[(n + i) / HALTON_2] / HALTON_2 + shift1;
+      POINT_X(points, i) = (u >= 1.0 ? u - 1.0 : u);
+      u = halton_3[(n + i) % HALTON_3] + halton_3[(n + i) / HALTON_3] / HALTON_3 + shift2;
+      POINT_Y(points, i) = (u >= 1.0 ? u - 1.0 : u);
+    }
+    within += mcarlo->kernel->count(points, BATCH_SIZE);
+  }
+  return within;
+}
+
+static const t_estimator        estimators[] =
+{
+  {"plain", plain_chunk, 0},
+  {"antithetic", antithetic_chunk, 0},
+  {"stratified", stratified_chunk, 1},
+  {"sobol", sobol_chunk, 1},
+  {"halton", halton_chunk, 1},
+};
+
+/**
+ * Estimator called `name`, NULL if there is none
+ */
+const t_estimator               *estimator_from_name(const char *name)
+{
+  size_t                        i;
+
+  for (i = 0 ; i < sizeof(estimators) / sizeof(*estimators) ; ++i)
+    if (strcmp(estimators[i].name, name) == 0)
+      return &estimators[i];
+  return NULL;
+}
+
+/**
+ * Adds the finite `value` to `acc`: its significand moved to its exponent
+ * (in units of ACC_LSB) spans two words, then the carry (or the borrow)
+ * goes up as far as it has to
+ */
+static void                     acc_add(t_accumulator *acc, double value)
+{
+  uint64_t                      bits, mantissa, word[2], old, add, carry = 0;
+  unsigned int                  exponent, limb, i;
+  int                           negative;
+
+  memcpy(&bits, &value, sizeof(bits));
+  negative = (int)(bits >> 63);
+  exponent = (bits >> 52) & 0x7FF;
+  mantissa = bits & ((1ULL << 52) - 1);
+  /* Normal numbers have the implicit bit, and the exponent of the subnormals */
+  if (exponent > 0)
+    mantissa |= 1ULL << 52, --exponent;
+  limb = exponent / 64;
+  word[0] = mantissa << (exponent % 64);
+  word[1] = (exponent % 64 > 0 ? mantissa >> (64 - exponent % 64) : 0);
+  for (i = limb ; i < ACC_LIMBS && (i < limb + 2 || carry != 0) ; ++i)
+  {
+    old = acc->limbs[i];
+    add = (i < limb + 2 ? word[i - limb] : 0);
+    if (negative)
+    {
+      acc->limbs[i] = old - add - carry;
+      carry = (old < add || (carry != 0 && old == add));
+    }
+    else
+    {
+      acc->limbs[i] = old + add + carry;
+      carry = (acc->limbs[i] < old || (carry != 0 && acc->limbs[i] == old));
+    }
+  }
+}
+
+static void                     acc_merge(t_accumulator *total, const t_accumulator *acc)
+{
+  uint64_t                      old, carry = 0;
+  unsigned int                  i;
+
+  for (i = 0 ; i < ACC_LIMBS ; ++i)
+  {
+    old = total->limbs[i];
+    total->limbs[i] = old + acc->limbs[i] + carry;
+    carry = (total->limbs[i] < old || (carry != 0 && total->limbs[i] == old));
+  }
+}
+
+/**
+ * The accumulated sum rounded once to a double: the two top words, with
+ * the lowest bit set if any word under them isn't 0 so the ties round right
+ */
+double                          acc_value(const t_accumulator *acc)
+{
+  uint64_t                      limbs[ACC_LIMBS], carry = 1;
+  t_u128                        top;
+  double                        value;
+  int                           negative, i, t;
+
+  memcpy(limbs, acc->limbs, sizeof(limbs));
+  if ((negative = (int)(limbs[ACC_LIMBS - 1] >> 63)))
+    for (i = 0 ; i < ACC_LIMBS ; ++i)
+    {
+      limbs[i] = ~limbs[i] + carry;
+      carry = (carry != 0 && limbs[i] == 0);
+    }
+  for (t = ACC_LIMBS - 1 ; t > 1 && limbs[t] == 0 ; --t)
+    ;
+  top = ((t_u128)limbs[t] << 64) | limbs[t - 1];
+  for (i = 0 ; i < t - 1 ; ++i)
+    top |= (limbs[i] != 0);
+  value = ldexp((double)top, 64 * (t - 1) + ACC_LSB);
+  return negative ? -value : value;
+}
+
+/**
+ * Adds a chunk, its estimate only counting for the error if it is full
+ */
+void                            stats_add(t_stats *stats, unsigned long long points, double sum, double scale)
+{
+  double                        estimate = scale * sum / points, delta;
+
+  stats->points += points;
+  if (!isfinite(sum))
+    stats->invalid = 1;
+  else
+    acc_add(&stats->sum, sum);
+  if (points != CHUNK_SIZE)
+    return;
+  delta = estimate - stats->mean;
+  stats->mean += delta / ++stats->chunks;
+  stats->m2 += delta * (estimate - stats->mean);
+}
+
+/* Chan et al. pairwise merge of the chunk estimates, the sums are exact */
+void                            stats_merge(t_stats *total, const t_stats *stats)
+{
+  unsigned long long            chunks = total->chunks + stats->chunks;
+  double                        delta = stats->mean - total->mean;
+
+  total->points += stats->points;
+  acc_merge(&total->sum, &stats->sum);
+  total->invalid |= stats->invalid;
+  if (chunks == 0)
+    return;
+  total->m2 += stats->m2 + delta * delta * ((double)total->chunks * stats->chunks / chunks);
+  total->mean += delta * ((double)stats->chunks / chunks);
+  total->chunks = chunks;
+}
+
+/* scale * sum / points, the same bits whichever order the chunks came in */
+double                          stats_value(const t_mcarlo *mcarlo, const t_stats *stats)
+{
+  if (stats->points == 0)
+    return NAN;
+  return mcarlo->scale * (acc_value(&stats->sum) / stats->points);
+}
+
+/**
+ * ERROR_Z standard errors of the estimate, from the spread of the chunks
+ * (for PI, the binomial one of single points until there are 2 full
+ * chunks)
+ */
+double                          stats_error(const t_mcarlo *mcarlo, const t_stats *stats)
+{
+  double                        p;
+
+  if (stats->chunks >= 2)
+    return ERROR_Z * sqrt(stats->m2 / (stats->chunks - 1) / stats->chunks);
+  if (stats->points == 0 || mcarlo->integrand != NULL)
+    return INFINITY;
+  p = stats_value(mcarlo, stats) / mcarlo->scale;
+  return ERROR_Z * mcarlo->scale * sqrt(p * (1.0 - p) / stats->points);
+}
+
+/**
+ * Adds a chunk to the worker's stats, inside the odd `seq` window so a
+ * snapshot never copies half of it
+ */
+void                            stats_commit(const t_mcarlo *mcarlo, t_local *local, unsigned long long points, double sum)
+{
+  __atomic_store_n(&local->seq, local->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  stats_add(&local->stats, points, sum, mcarlo->scale);
+  __atomic_store_n(&local->seq, local->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Merges the stats of every worker while they carry on, each copy being
+ * retried until its worker didn't commit a chunk in the middle of it
+ */
+void                            stats_snapshot(const t_mcarlo *mcarlo, t_stats *total)
+{
+  const t_local                 *local;
+  unsigned long long            seq;
+  t_stats                       stats;
+  unsigned int                  i;
+
+  memset(total, 0, sizeof(*total));
+  for (i = 0 ; i < mcarlo->thread_count ; ++i)
+  {
+    if ((local = __atomic_load_n(&mcarlo->threads[i].local, __ATOMIC_ACQUIRE)) == NULL)
+      continue;
+    do
+    {
+      while ((seq = __atomic_load_n(&local->seq, __ATOMIC_ACQUIRE)) % 2 == 1)
+        sched_yield();
+      memcpy(&stats, (const void *)&local->stats, sizeof(stats));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&local->seq, __ATOMIC_RELAXED) != seq);
+    stats_merge(total, &stats);
+  }
+}
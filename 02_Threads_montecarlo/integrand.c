@@ -0,0 +1,162 @@
+/**
+ * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
+ *
+ * Integration of --integrand over the --bounds of its --dims dimensions,
+ * on the same workers, streams and chunks as PI: the chunk sum is the sum
+ * of the integrand over the points drawn uniformly in the bounds, and the
+ * estimate their mean times the volume. The integrands are evaluated a
+ * batch at a time, one array per coordinate.
+ */
+#include <math.h>
+#include <string.h>
+#include "mcarlo.h"
+
+/* Indicator of the unit ball: its volume when the bounds hold it */
+static void                     sphere_eval(const double *x, size_t stride, size_t count, unsigned int dims, double *f)
+{
+  size_t                        i;
+  unsigned int                  d;
+
+  memset(f, 0, count * sizeof(*f));
+  for (d = 0 ; d < dims ; ++d)
+    for (i = 0 ; i < count ; ++i)
+      f[i] += x[d * stride + i] * x[d * stride + i];
+  for (i = 0 ; i < count ; ++i)
+    f[i] = (f[i] < 1.0);
+}
+
+static double                   sphere_exact(unsigned int dims, const double *lower, const double *upper)
+{
+  unsigned int                  d;
+
+  for (d = 0 ; d < dims ; ++d)
+    if (lower[d] > -1.0 || upper[d] < 1.0)
+      return NAN;
+  return pow(M_PI, dims / 2.0) / tgamma(dims / 2.0 + 1.0);
+}
+
+/* exp(-|x|^2) */
+static void                     gaussian_eval(const double *x, size_t stride, size_t count, unsigned int dims, double *f)
+{
+  size_t                        i;
+  unsigned int                  d;
+
+  memset(f, 0, count * sizeof(*f));
+  for (d = 0 ; d < dims ; ++d)
+    for (i = 0 ; i < count ; ++i)
+      f[i] += x[d * stride + i] * x[d * stride + i];
+  for (i = 0 ; i < count ; ++i)
+    f[i] = exp(-f[i]);
+}
+
+/* erfc in the tails, where erf(upper) - erf(lower) cancels out to nothing */
+static double                   gaussian_exact(unsigned int dims, const double *lower, const double *upper)
+{
+  double                        exact = 1.0;
+  unsigned int                  d;
+
+  for (d = 0 ; d < dims ; ++d)
+    if (lower[d] > 0.0)
+      exact *= sqrt(M_PI) / 2.0 * (erfc(lower[d]) - erfc(upper[d]));
+    else if (upper[d] < 0.0)
+      exact *= sqrt(M_PI) / 2.0 * (erfc(-upper[d]) - erfc(-lower[d]));
+    else
+      exact *= sqrt(M_PI) / 2.0 * (erf(upper[d]) - erf(lower[d]));
+  return exact;
+}
+
+/* Product of the cos(x_d) */
+static void                     cosine_eval(const double *x, size_t stride, size_t count, unsigned int dims, double *f)
+{
+  size_t                        i;
+  unsigned int                  d;
+
+  for (i = 0 ; i < count ; ++i)
+    f[i] = 1.0;
+  for (d = 0 ; d < dims ; ++d)
+    for (i = 0 ; i < count ; ++i)
+      f[i] *= cos(x[d * stride + i]);
+}
+
+static double                   cosine_exact(unsigned int dims, const double *lower, const double *upper)
+{
+  double                        exact = 1.0;
+  unsigned int                  d;
+
+  for (d = 0 ; d < dims ; ++d)
+    exact *= sin(upper[d]) - sin(lower[d]);
+  return exact;
+}
+
+/* |x|^2 */
+static void                     square_eval(const double *x, size_t stride, size_t count, unsigned int dims, double *f)
+{
+  size_t                        i;
+  unsigned int                  d;
+
+  memset(f, 0, count * sizeof(*f));
+  for (d = 0 ; d < dims ; ++d)
+    for (i = 0 ; i < count ; ++i)
+      f[i] += x[d * stride + i] * x[d * stride + i];
+}
+
+static double                   square_exact(unsigned int dims, const double *lower, const double *upper)
+{
+  double                        exact = 0.0, volume;
+  unsigned int                  d, k;
+
+  for (d = 0 ; d < dims ; ++d)
+  {
+    for (k = 0, volume = 1.0 ; k < dims ; ++k)
+      volume *= (k == d ? (pow(upper[k], 3) - pow(lower[k], 3)) / 3.0 : upper[k] - lower[k]);
+    exact += volume;
+  }
+  return exact;
+}
+
+static const t_integrand        integrands[] =
+{
+  {"sphere", -1.0, 1.0, sphere_eval, sphere_exact},
+  {"gaussian", -1.0, 1.0, gaussian_eval, gaussian_exact},
+  {"cosine", 0.0, M_PI / 2.0, cosine_eval, cosine_exact},
+  {"square", 0.0, 1.0, square_eval, square_exact},
+};
+
+/**
+ * Integrand called `name`, NULL if there is none
+ */
+const t_integrand               *integrand_from_name(const char *name)
+{
+  size_t                        i;
+
+  for (i = 0 ; i < sizeof(integrands) / sizeof(*integrands) ; ++i)
+    if (strcmp(integrands[i].name, name) == 0)
+      return &integrands[i];
+  return NULL;
+}
+
+/**
+ * Sum of the integrand over a chunk, added batch after batch in the order
+ * of the points so a chunk always sums to the same bits
+ */
+static double                   integrand_chunk(const t_mcarlo *mcarlo, t_prng *prng, size_t count, double *points)
+{
+  double                        f[BATCH_SIZE], sum = 0.0;
+  size_t                        done, batch, i;
+  unsigned int                  d;
+
+  for (done = 0 ; done < count ; done += batch)
+  {
+    batch = (count - done < BATCH_SIZE ? count - done : BATCH_SIZE);
+    mcarlo->prng->fill(prng, points, mcarlo->dims * batch);
+    for (d = 0 ; d < mcarlo->dims ; ++d)
+      for (i = 0 ; i < batch ; ++i)
+        points[d * batch + i] = mcarlo->lower[d] + UNIT(points[d * batch + i]) * (mcarlo->upper[d] - mcarlo->lower[d]);
+    mcarlo->integrand->eval(points, batch, batch, mcarlo->dims, f);
+    for (i = 0 ; i < batch ; ++i)
+      sum += f[i];
+  }
+  return sum;
+}
+
+const t_estimator               integrand_estimator = {"integrand", integrand_chunk, 0};
@@ -0,0 +1,330 @@
+/**
+ * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
+ *
+ * Point-in-circle kernels: x^2 + y^2 < 1 on POINT_LANES points at a time,
+ * the compare mask of a vector is popcounted into the hits. With xoshiro
+ * the SIMD kernels also draw the points, one xoshiro lane per vector lane,
+ * so they never go through memory.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <immintrin.h>
+#include "mcarlo.h"
+
+/* The lanes of the last vector of a batch which are points */
+#define TAIL_MASK(count, i)     ((count) - (i) < POINT_LANES ? (1U << ((count) - (i))) - 1 : 0xFFU)
+
+static unsigned long long       count_scalar(const double *points, size_t count)
+{
+  unsigned long long            within = 0;
+  size_t                        i;
+
+  for (i = 0 ; i < count ; ++i)
+    within += WITHIN_CIRCLE(POINT_X(points, i), POINT_Y(points, i));
+  return within;
+}
+
+/* u = UNIT(x) of the draw x in [-1, 1), its twin 1 - u is UNIT(-x) */
+static unsigned long long       antithetic_scalar(const double *points, size_t count)
+{
+  unsigned long long            within = 0;
+  double                        x, y;
+  size_t                        i;
+
+  for (i = 0 ; i < count ; ++i)
+  {
+    x = POINT_X(points, i);
+    y = POINT_Y(points, i);
+    within += WITHIN_CIRCLE(UNIT(x), UNIT(y)) + WITHIN_CIRCLE(UNIT(-x), UNIT(-y));
+  }
+  return within;
+}
+
+/**
+ * AVX2: the POINT_LANES lanes are two vectors of 4
+ */
+__attribute__((target("avx2,fma,popcnt")))
+static inline unsigned          within_avx2(__m256d x0, __m256d x1, __m256d y0, __m256d y1)
+{
+  const __m256d                 one = _mm256_set1_pd(1.0);
+  __m256d                       r0 = _mm256_fmadd_pd(x0, x0, _mm256_mul_pd(y0, y0));
+  __m256d                       r1 = _mm256_fmadd_pd(x1, x1, _mm256_mul_pd(y1, y1));
+
+  return _mm256_movemask_pd(_mm256_cmp_pd(r0, one, _CMP_LT_OQ))
+    | _mm256_movemask_pd(_mm256_cmp_pd(r1, one, _CMP_LT_OQ)) << 4;
+}
+
+__attribute__((target("avx2,fma,popcnt")))
+static unsigned long long       count_avx2(const double *points, size_t count)
+{
+  unsigned long long            within = 0;
+  const double                  *p;
+  size_t                        i;
+
+  for (i = 0, p = points ; i < count ; i += POINT_LANES, p += 2 * POINT_LANES)
+    within += _mm_popcnt_u32(TAIL_MASK(count, i) & within_avx2(_mm256_loadu_pd(p), _mm256_loadu_pd(p + 4),
+                                                                _mm256_loadu_pd(p + 8), _mm256_loadu_pd(p + 12)));
+  return within;
+}
+
+/* Both tests of the antithetic pairs: UNIT(x) = 0.5 x + 0.5, UNIT(-x) = 0.5 - 0.5 x */
+__attribute__((target("avx2,fma,popcnt")))
+static inline unsigned          antithetic_avx2(__m256d x0, __m256d x1, __m256d y0, __m256d y1, unsigned mask)
+{
+  const __m256d                 half = _mm256_set1_pd(0.5);
+
+  return _mm_popcnt_u32(mask & within_avx2(_mm256_fmadd_pd(x0, half, half), _mm256_fmadd_pd(x1, half, half),
+                                           _mm256_fmadd_pd(y0, half, half), _mm256_fmadd_pd(y1, half, half)))
+    + _mm_popcnt_u32(mask & within_avx2(_mm256_fnmadd_pd(x0, half, half), _mm256_fnmadd_pd(x1, half, half),
+                                        _mm256_fnmadd_pd(y0, half, half), _mm256_fnmadd_pd(y1, half, half)));
+}
+
+__attribute__((target("avx2,fma,popcnt")))
+static unsigned long long       count_antithetic_avx2(const double *points, size_t count)
+{
+  unsigned long long            within = 0;
+  const double                  *p;
+  size_t                        i;
+
+  for (i = 0, p = points ; i < count ; i += POINT_LANES, p += 2 * POINT_LANES)
+    within += antithetic_avx2(_mm256_loadu_pd(p), _mm256_loadu_pd(p + 4), _mm256_loadu_pd(p + 8),
+                              _mm256_loadu_pd(p + 12), TAIL_MASK(count, i));
+  return within;
+}
+
+/* 2d - 3 of the double d in [1, 2) holding the top 52 bits of x, as to_double() */
+__attribute__((target("avx2,fma")))
+static inline __m256d           to_double_avx2(__m256i x)
+{
+  const __m256i                 exponent = _mm256_set1_epi64x(0x3FF0000000000000LL);
+  __m256d                       d = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(x, 12), exponent));
+
+  return _mm256_fmsub_pd(d, _mm256_set1_pd(2.0), _mm256_set1_pd(3.0));
+}
+
+/* xoshiro256** step of 4 lanes: s1 * 5 and * 9 are shifts and adds (no 64 bits mullo in AVX2) */
+#define ROTL_AVX2(x, k)         _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - (k)))
+
+__attribute__((target("avx2,fma")))
+static inline __m256d           xoshiro_avx2(__m256i s[4])
+{
+  __m256i                       r = _mm256_add_epi64(_mm256_slli_epi64(s[1], 2), s[1]);
+  __m256i                       t = _mm256_slli_epi64(s[1], 17);
+
+  r = ROTL_AVX2(r, 7);
+  r = _mm256_add_epi64(_mm256_slli_epi64(r, 3), r);
+  s[2] = _mm256_xor_si256(s[2], s[0]);
+  s[3] = _mm256_xor_si256(s[3], s[1]);
+  s[1] = _mm256_xor_si256(s[1], s[2]);
+  s[0] = _mm256_xor_si256(s[0], s[3]);
+  s[2] = _mm256_xor_si256(s[2], t);
+  s[3] = ROTL_AVX2(s[3], 45);
+  return to_double_avx2(r);
+}
+
+__attribute__((target("avx2,fma,popcnt")))
+static unsigned long long       draw_avx2(t_prng *prng, size_t count)
+{
+  unsigned long long            within = 0;
+  __m256i                       lo[4], hi[4];
+  __m256d                       x0, x1;
+  size_t                        i;
+  int                           w;
+
+  for (w = 0 ; w < 4 ; ++w)
+  {
+    lo[w] = _mm256_loadu_si256((const __m256i *)&prng->xoshiro[w][0]);
+    hi[w] = _mm256_loadu_si256((const __m256i *)&prng->xoshiro[w][4]);
+  }
+  for (i = 0 ; i < count ; i += POINT_LANES)
+  {
+    x0 = xoshiro_avx2(lo);
+    x1 = xoshiro_avx2(hi);
+    within += _mm_popcnt_u32(TAIL_MASK(count, i) & within_avx2(x0, x1, xoshiro_avx2(lo), xoshiro_avx2(hi)));
+  }
+  for (w = 0 ; w < 4 ; ++w)
+  {
+    _mm256_storeu_si256((__m256i *)&prng->xoshiro[w][0], lo[w]);
+    _mm256_storeu_si256((__m256i *)&prng->xoshiro[w][4], hi[w]);
+  }
+  return within;
+}
+
+__attribute__((target("avx2,fma,popcnt")))
+static unsigned long long       draw_antithetic_avx2(t_prng *prng, size_t count)
+{
+  unsigned long long            within = 0;
+  __m256i                       lo[4], hi[4];
+  __m256d                       x0, x1;
+  size_t                        i;
+  int                           w;
+
+  for (w = 0 ; w < 4 ; ++w)
+  {
+    lo[w] = _mm256_loadu_si256((const __m256i *)&prng->xoshiro[w][0]);
+    hi[w] = _mm256_loadu_si256((const __m256i *)&prng->xoshiro[w][4]);
+  }
+  for (i = 0 ; i < count ; i += POINT_LANES)
+  {
+    x0 = xoshiro_avx2(lo);
+    x1 = xoshiro_avx2(hi);
+    within += antithetic_avx2(x0, x1, xoshiro_avx2(lo), xoshiro_avx2(hi), TAIL_MASK(count, i));
+  }
+  for (w = 0 ; w < 4 ; ++w)
+  {
+    _mm256_storeu_si256((__m256i *)&prng->xoshiro[w][0], lo[w]);
+    _mm256_storeu_si256((__m256i *)&prng->xoshiro[w][4], hi[w]);
+  }
+  return within;
+}
+
+/**
+ * AVX-512: the POINT_LANES lanes are one vector, the compare gives the mask
+ */
+__attribute__((target("avx512f,popcnt")))
+static inline unsigned          within_avx512(__m512d x, __m512d y)
+{
+  __m512d                       r = _mm512_fmadd_pd(x, x, _mm512_mul_pd(y, y));
+
+  return _mm512_cmp_pd_mask(r, _mm512_set1_pd(1.0), _CMP_LT_OQ);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static unsigned long long       count_avx512(const double *points, size_t count)
+{
+  unsigned long long            within = 0;
+  const double                  *p;
+  size_t                        i;
+
+  for (i = 0, p = points ; i < count ; i += POINT_LANES, p += 2 * POINT_LANES)
+    within += _mm_popcnt_u32(TAIL_MASK(count, i) & within_avx512(_mm512_loadu_pd(p), _mm512_loadu_pd(p + 8)));
+  return within;
+}
+
+__attribute__((target("avx512f,popcnt")))
+static inline unsigned          antithetic_avx512(__m512d x, __m512d y, unsigned mask)
+{
+  const __m512d                 half = _mm512_set1_pd(0.5);
+
+  return _mm_popcnt_u32(mask & within_avx512(_mm512_fmadd_pd(x, half, half), _mm512_fmadd_pd(y, half, half)))
+    + _mm_popcnt_u32(mask & within_avx512(_mm512_fnmadd_pd(x, half, half), _mm512_fnmadd_pd(y, half, half)));
+}
+
+__attribute__((target("avx512f,popcnt")))
+static unsigned long long       count_antithetic_avx512(const double *points, size_t count)
+{
+  unsigned long long            within = 0;
+  const double                  *p;
+  size_t                        i;
+
+  for (i = 0, p = points ; i < count ; i += POINT_LANES, p += 2 * POINT_LANES)
+    within += antithetic_avx512(_mm512_loadu_pd(p), _mm512_loadu_pd(p + 8), TAIL_MASK(count, i));
+  return within;
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d           xoshiro_avx512(__m512i s[4])
+{
+  const __m512i                 exponent = _mm512_set1_epi64(0x3FF0000000000000LL);
+  __m512i                       r = _mm512_add_epi64(_mm512_slli_epi64(s[1], 2), s[1]);
+  __m512i                       t = _mm512_slli_epi64(s[1], 17);
+
+  r = _mm512_rol_epi64(r, 7);
+  r = _mm512_add_epi64(_mm512_slli_epi64(r, 3), r);
+  s[2] = _mm512_xor_si512(s[2], s[0]);
+  s[3] = _mm512_xor_si512(s[3], s[1]);
+  s[1] = _mm512_xor_si512(s[1], s[2]);
+  s[0] = _mm512_xor_si512(s[0], s[3]);
+  s[2] = _mm512_xor_si512(s[2], t);
+  s[3] = _mm512_rol_epi64(s[3], 45);
+  r = _mm512_or_si512(_mm512_srli_epi64(r, 12), exponent);
+  return _mm512_fmsub_pd(_mm512_castsi512_pd(r), _mm512_set1_pd(2.0), _mm512_set1_pd(3.0));
+}
+
+__attribute__((target("avx512f,popcnt")))
+static unsigned long long       draw_avx512(t_prng *prng, size_t count)
+{
+  unsigned long long            within = 0;
+  __m512i                       s[4];
+  __m512d                       x;
+  size_t                        i;
+  int                           w;
+
+  for (w = 0 ; w < 4 ; ++w)
+    s[w] = _mm512_loadu_si512(prng->xoshiro[w]);
+  for (i = 0 ; i < count ; i += POINT_LANES)
+  {
+    x = xoshiro_avx512(s);
+    within += _mm_popcnt_u32(TAIL_MASK(count, i) & within_avx512(x, xoshiro_avx512(s)));
+  }
+  for (w = 0 ; w < 4 ; ++w)
+    _mm512_storeu_si512(prng->xoshiro[w], s[w]);
+  return within;
+}
+
+__attribute__((target("avx512f,popcnt")))
+static unsigned long long       draw_antithetic_avx512(t_prng *prng, size_t count)
+{
+  unsigned long long            within = 0;
+  __m512i                       s[4];
+  __m512d                       x;
+  size_t                        i;
+  int                           w;
+
+  for (w = 0 ; w < 4 ; ++w)
+    s[w] = _mm512_loadu_si512(prng->xoshiro[w]);
+  for (i = 0 ; i < count ; i += POINT_LANES)
+  {
+    x = xoshiro_avx512(s);
+    within += antithetic_avx512(x, xoshiro_avx512(s), TAIL_MASK(count, i));
+  }
+  for (w = 0 ; w < 4 ; ++w)
+    _mm512_storeu_si512(prng->xoshiro[w], s[w]);
+  return within;
+}
+
+static const t_kernel           kernels[KERNEL_COUNT] =
+{
+  [KERNEL_AUTO] = {"auto", NULL, NULL, NULL, NULL, NULL},
+  [KERNEL_SCALAR] = {"scalar", count_scalar, NULL, antithetic_scalar, NULL, NULL},
+  [KERNEL_AVX2] = {"avx2", count_avx2, draw_avx2, count_antithetic_avx2, draw_antithetic_avx2, "avx2"},
+  [KERNEL_AVX512] = {"avx512", count_avx512, draw_avx512, count_antithetic_avx512, draw_antithetic_avx512, "avx512f"},
+};
+
+const t_kernel                  *kernel_get(t_kernel_id id)
+{
+  return &kernels[id];
+}
+
+static int                      kernel_supported(t_kernel_id id)
+{
+  __builtin_cpu_init();
+  if (id == KERNEL_AVX2)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("popcnt");
+  if (id == KERNEL_AVX512)
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt");
+  return id == KERNEL_SCALAR;
+}
+
+/**
+ * Returns the kernel matching `name` (the widest the CPU runs for "auto",
+ * the next narrower one if it can't run the requested one), or
+ * KERNEL_COUNT if there is none
+ */
+t_kernel_id                     kernel_from_name(const char *name)
+{
+  t_kernel_id                   id;
+
+  for (id = KERNEL_AUTO ; id < KERNEL_COUNT ; ++id)
+    if (strcmp(kernels[id].name, name) == 0)
+      break;
+  if (id == KERNEL_COUNT)
+    return id;
+  if (id == KERNEL_AUTO)
+    id = KERNEL_AVX512;
+  else if (!kernel_supported(id))
+    fprintf(stderr, "[~] This CPU has no %s, falling back to a narrower kernel\n", kernels[id].cpu_feature);
+  while (!kernel_supported(id))
+    --id;
+  return id;
+}
@@ -1,95 +1,240 @@
 /**
  * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
  *
- * Compile with: gcc ./mcarlo.c -o mcarlo -lpthread -lm 
+ * Compile with: ./compile.sh (./compile.sh bench for the points/s of 1 to N threads)
  */
+#define _GNU_SOURCE
+#include <sched.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <time.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "mcarlo.h"
 
-#define RETURN_SUCCESS         (0)
-#define RETURN_FAILURE         (1)
-#define THREAD_SUCCESS         (RETURN_SUCCESS)
-#define THREAD_FAILURE         (RETURN_FAILURE)
-#define SYSCALL_FAILURE        (-1)
+/* General results structure (Shared memory) */
+t_mcarlo                        mcarlo = {.prng = NULL, .scale = 4.0};
 
-#define PROGRESS               (1)
+/* Threads array (--threads of them), keep the track of each thread */
+t_thread                        *threads = NULL;
 
-#define WORKER_COUNT           (4)
-#define WITHIN_CIRCLE(x, y)    (sqrt(x*x + y*y) < 1)
-#define RANDOM_DOUBLE          ((random() / ((double)RAND_MAX + 1)) * 2.0 - 1.0)
-#define PI(a, b)               ((double)(4.0 * ((double)b / (double)a)))
+/* Progress reporter, every second by default */
+t_report                        report = {.interval = 1.0};
 
-typedef struct                  s_mcarlo
+static const struct option      options[] =
 {
-  unsigned long long            p_todo;
-  unsigned long long            p_count;
-  unsigned long long            p_within_circle;
-  double                        pi;
-}                               t_mcarlo;
+  {"seed", required_argument, NULL, 's'},
+  {"prng", required_argument, NULL, 'r'},
+  {"kernel", required_argument, NULL, 'k'},
+  {"threads", required_argument, NULL, 't'},
+  {"report", required_argument, NULL, 'p'},
+  {"json", no_argument, NULL, 'j'},
+  {"estimator", required_argument, NULL, 'e'},
+  {"epsilon", required_argument, NULL, 'E'},
+  {"integrand", required_argument, NULL, 'i'},
+  {"dims", required_argument, NULL, 'd'},
+  {"bounds", required_argument, NULL, 'b'},
+  {NULL, 0, NULL, 0}
+};
 
-typedef struct                  s_thread
+/**
+ * Bounds of the integrand from `spec`: "lower:upper" for every dimension,
+ * or one of them per dimension separated by commas (NULL: the
+ * integrand's), and the volume they enclose
+ */
+static int                      set_domain(const char *spec)
 {
-  pthread_t                     thread_id;
-  pthread_attr_t                thread_attr;
-  int                           status;
-  unsigned long long            computed_points;
-  t_mcarlo                      *mcarlo;
-}                               t_thread;
+  char                          *end;
+  unsigned int                  d, count = 0;
 
-/* Worker func ptr prototype */
-void                            *worker(void *arg);
+  if (mcarlo.estimator != estimator_from_name("plain"))
+    return RETURN_FAILURE;
+  mcarlo.dims = (mcarlo.dims > 0 ? mcarlo.dims : 2);
+  mcarlo.estimator = &integrand_estimator;
+  for (; spec != NULL && count < MAX_DIMS ; ++count, spec = (*end == ',' ? end + 1 : NULL))
+  {
+    mcarlo.lower[count] = strtod(spec, &end);
+    if (end == spec || *end != ':')
+      return RETURN_FAILURE;
+    mcarlo.upper[count] = strtod(spec = end + 1, &end);
+    if (end == spec || (*end != '\0' && *end != ',') || !(mcarlo.lower[count] < mcarlo.upper[count]))
+      return RETURN_FAILURE;
+  }
+  if (spec != NULL || (count > 1 && count != mcarlo.dims))
+    return RETURN_FAILURE;
+  for (d = 0, mcarlo.scale = 1.0 ; d < mcarlo.dims ; ++d)
+  {
+    mcarlo.lower[d] = (count == 0 ? mcarlo.integrand->lower : mcarlo.lower[count > 1 ? d : 0]);
+    mcarlo.upper[d] = (count == 0 ? mcarlo.integrand->upper : mcarlo.upper[count > 1 ? d : 0]);
+    mcarlo.scale *= mcarlo.upper[d] - mcarlo.lower[d];
+  }
+  return RETURN_SUCCESS;
+}
 
-/* General results structure (Shared memory) */
-t_mcarlo                        mcarlo = {0, 0, 0, 0.0};
+/**
+ * --seed (default: the current time in second), --prng (default: xoshiro),
+ * --kernel (default: the widest this CPU runs), --threads (default: one
+ * per online CPU), --report seconds between progress reports (0: none),
+ * --json for JSON lines reports, --estimator (default: plain) and
+ * --epsilon, to stop once the error bound is under it. --integrand
+ * integrates it instead of estimating PI, over --dims (default: 2)
+ * dimensions and --bounds (default: the integrand's)
+ */
+static int                      parse_options(int argc, char **argv)
+{
+  char                          *end, *bounds = NULL;
+  t_kernel_id                   kernel = kernel_from_name("auto");
+  long                          online = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned long                 count;
+  int                           opt, dims = 0;
 
-/* Creating a thread mutex to protect the access to a shared resource (avoiding dead locks ) */
-pthread_mutex_t                 lock;
+  mcarlo.thread_count = (online > 0 ? online : 1);
+  mcarlo.seed = time(NULL);
+  mcarlo.prng = prng_from_name("xoshiro");
+  mcarlo.estimator = estimator_from_name("plain");
+  while ((opt = getopt_long(argc, argv, "s:r:k:t:p:je:E:i:d:b:", options, NULL)) != -1)
+  {
+    if (opt == 's' && (mcarlo.seed = strtoull(optarg, &end, 0), *optarg != '\0' && *end == '\0'))
+      continue;
+    if (opt == 'r' && (mcarlo.prng = prng_from_name(optarg)) != NULL)
+      continue;
+    if (opt == 'k' && (kernel = kernel_from_name(optarg)) != KERNEL_COUNT)
+      continue;
+    if (opt == 't' && (count = strtoul(optarg, &end, 0), *optarg != '\0' && *end == '\0')
+        && count >= 1 && count <= MAX_THREADS)
+    {
+      mcarlo.thread_count = count;
+      continue;
+    }
+    if (opt == 'p' && (report.interval = strtod(optarg, &end), *optarg != '\0' && *end == '\0')
+        && isfinite(report.interval) && report.interval >= 0)
+      continue;
+    if (opt == 'e' && (mcarlo.estimator = estimator_from_name(optarg)) != NULL)
+      continue;
+    if (opt == 'E' && (mcarlo.epsilon = strtod(optarg, &end), *optarg != '\0' && *end == '\0')
+        && isfinite(mcarlo.epsilon) && mcarlo.epsilon > 0)
+      continue;
+    if (opt == 'j')
+    {
+      report.json = 1;
+      continue;
+    }
+    if (opt == 'i' && (mcarlo.integrand = integrand_from_name(optarg)) != NULL)
+      continue;
+    if (opt == 'd' && (count = strtoul(optarg, &end, 0), *optarg != '\0' && *end == '\0')
+        && count >= 1 && count <= MAX_DIMS)
+    {
+      mcarlo.dims = count;
+      dims = 1;
+      continue;
+    }
+    if (opt == 'b')
+    {
+      bounds = optarg;
+      continue;
+    }
+    return RETURN_FAILURE;
+  }
+  mcarlo.kernel = kernel_get(kernel);
+  if (mcarlo.integrand != NULL && set_domain(bounds) != RETURN_SUCCESS)
+    return RETURN_FAILURE;
+  return argc - optind == 1 && ((bounds == NULL && !dims) || mcarlo.integrand != NULL) ? RETURN_SUCCESS : RETURN_FAILURE;
+}
+
+/**
+ * Thread i runs on the i-th CPU this process may use (round robin when
+ * there are more threads than CPUs), -1 if the affinity is unknown
+ */
+static void                     assign_cpus(void)
+{
+  int                           cpus[CPU_SETSIZE];
+  int                           cpu, cpu_count = 0;
+  unsigned int                  i;
+  cpu_set_t                     set;
 
-/* Threads array, keep the track of each thread */
-t_thread                        threads[WORKER_COUNT];
+  if (sched_getaffinity(0, sizeof(set), &set) != SYSCALL_FAILURE)
+    for (cpu = 0 ; cpu < CPU_SETSIZE ; ++cpu)
+      if (CPU_ISSET(cpu, &set))
+        cpus[cpu_count++] = cpu;
+  for (i = 0 ; i < mcarlo.thread_count ; ++i)
+    threads[i].cpu = (cpu_count > 0 ? cpus[i % cpu_count] : -1);
+}
 
 int                             main(int argc, char **argv)
 {
   unsigned int                  i = 0;
   long long                     point_number = 0;
+  struct timespec               start, end;
+  double                        elapsed;
+  cpu_set_t                     set;
+  t_local                       *local;
+  t_stats                       total;
+  FILE                          *out;
 
   /* Checking command line parameters */
-  if (argc < 2)  
+  if (parse_options(argc, argv) != RETURN_SUCCESS)
   {
-    fprintf(stderr, "[^] USAGE: ./mcarlo <point_number>\n");
+    fprintf(stderr, "[^] USAGE: ./mcarlo [--threads n] [--seed n] [--prng xoshiro|pcg64|philox] "
+            "[--kernel auto|scalar|avx2|avx512] [--estimator plain|antithetic|stratified|sobol|halton] "
+            "[--epsilon e] [--report sec] [--json] [--integrand sphere|gaussian|cosine|square [--dims n] "
+            "[--bounds lower:upper[,lower:upper..]]] <point_number>\n");
     return RETURN_FAILURE;
   }
-  /* Converting the char* argv[1] into long long */
-  if ((point_number = atoll(argv[1])) < 1)
+  /* Converting the char* argument into long long */
+  if ((point_number = atoll(argv[optind])) < 1 || (unsigned long long)point_number > MAX_CHUNKS * CHUNK_SIZE)
   {
-    fprintf(stderr, "[-] point_number should be >= 1\n");
+    fprintf(stderr, "[-] point_number should be >= 1 and <= %llu\n", MAX_CHUNKS * CHUNK_SIZE);
     return RETURN_FAILURE;
   }
-  /* Initializing mutex */
-  if (pthread_mutex_init(&lock, NULL) != 0)
+  if ((threads = aligned_alloc(CACHE_LINE, mcarlo.thread_count * sizeof(*threads))) == NULL)
   {
-    fprintf(stderr, "[-] Failed to init mutex !\n");
+    perror("aligned_alloc");
     return RETURN_FAILURE;
   }
-  /* Setting the random seed to the currant time in second */
-  srand(time(NULL));
+  memset(threads, 0, mcarlo.thread_count * sizeof(*threads));
+  mcarlo.threads = threads;
+  assign_cpus();
 
-  /* Number of points to compute stored in the working structure */
+  /* The JSON lines reports have stdout to themselves */
+  out = (report.json ? stderr : stdout);
+
+  /* Number of points to compute (at most, with --epsilon) stored in the working structure */
   mcarlo.p_todo = point_number;
+  if (mcarlo.estimator->whole_chunks && mcarlo.p_todo % CHUNK_SIZE != 0)
+  {
+    mcarlo.p_todo += CHUNK_SIZE - mcarlo.p_todo % CHUNK_SIZE;
+    fprintf(stderr, "[~] Rounding up to %llu points, --estimator %s draws whole chunks of %d\n", mcarlo.p_todo,
+            mcarlo.estimator->name, CHUNK_SIZE);
+  }
 
   /* Initializing threads, then, start them */
-  printf("[~] Launching %d threads with points number %llu ..\n", WORKER_COUNT, point_number);
-  for (i = 0 ; i < WORKER_COUNT ; ++i)
+  if (mcarlo.integrand != NULL)
+    fprintf(out, "[~] Launching %u threads with points number %llu (--seed %llu --prng %s --integrand %s --dims %u) ..\n",
+            mcarlo.thread_count, mcarlo.p_todo, mcarlo.seed, mcarlo.prng->name, mcarlo.integrand->name, mcarlo.dims);
+  else
+    fprintf(out, "[~] Launching %u threads with points number %llu (--seed %llu --prng %s --kernel %s --estimator %s) ..\n",
+            mcarlo.thread_count, mcarlo.p_todo, mcarlo.seed, mcarlo.prng->name, mcarlo.kernel->name, mcarlo.estimator->name);
+  scheduler_init(&mcarlo);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  report_start(&report, &mcarlo);
+  for (i = 0 ; i < mcarlo.thread_count ; ++i)
   {
     /* By default, the thread succeed */
+    threads[i].index = i;
     threads[i].status = THREAD_SUCCESS;
     threads[i].mcarlo = &mcarlo;
-    /* Setting default thread attr */
+    /* Setting default thread attr, pinned to its CPU */
     pthread_attr_init(&threads[i].thread_attr);
+    if (threads[i].cpu >= 0)
+    {
+      CPU_ZERO(&set);
+      CPU_SET(threads[i].cpu, &set);
+      if (pthread_attr_setaffinity_np(&threads[i].thread_attr, sizeof(set), &set) != RETURN_SUCCESS)
+        fprintf(stderr, "[~] Thread %d won't be pinned to CPU %d\n", i, threads[i].cpu);
+    }
     /* Starting threads */
     if (pthread_create(&threads[i].thread_id, &threads[i].thread_attr, worker, &threads[i]) != RETURN_SUCCESS)
     {
@@ -98,60 +243,114 @@ int                             main(int argc, char **argv)
     }
   }
 
-  /* Waiting for the threads to finish */
-  for (i = 0 ; i < WORKER_COUNT ; ++i)
+  /* Waiting for the threads to finish, the others steal the chunks of a thread which didn't start */
+  for (i = 0 ; i < mcarlo.thread_count ; ++i)
   {
+    if (threads[i].status == THREAD_FAILURE)
+      continue;
     /* Waiting for thread i to finish */
     pthread_join(threads[i].thread_id, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  report_stop(&report);
 
+  /* Merging the per-thread stats, in thread order */
+  memset(&total, 0, sizeof(total));
+  for (i = 0 ; i < mcarlo.thread_count ; ++i)
+  {
+    pthread_attr_destroy(&threads[i].thread_attr);
+    if ((local = threads[i].local) == NULL)
+      continue;
     /* Display thread computed points */
-    printf("Thread [%d] Computed Points: %llu\n", i, threads[i].computed_points);
+    fprintf(out, "Thread [%d] Computed Points: %llu (CPU %d, %.0f points/s)\n", i, local->stats.points, threads[i].cpu,
+           local->elapsed > 0 ? local->stats.points / local->elapsed : 0.0);
+    stats_merge(&total, &local->stats);
+    munmap(local, sizeof(*local));
   }
+  free(threads);
+  mcarlo.p_count = total.points;
+  mcarlo.p_within_circle = (unsigned long long)acc_value(&total.sum);
+  if (mcarlo.p_count == 0)
+  {
+    fprintf(stderr, "[-] No thread could start\n");
+    return RETURN_FAILURE;
+  }
+  if (!mcarlo.stop && mcarlo.p_count != mcarlo.p_todo)
+  {
+    fprintf(stderr, "[-] Only %llu/%llu points were drawn\n", mcarlo.p_count, mcarlo.p_todo);
+    return RETURN_FAILURE;
+  }
+  if (total.invalid)
+  {
+    fprintf(stderr, "[-] The integrand doesn't sum to a finite number over a chunk\n");
+    return RETURN_FAILURE;
+  }
+  mcarlo.pi = stats_value(&mcarlo, &total);
 
-  printf("[+] All Threads finished ! %llu/%llu PI = %f\n", mcarlo.p_within_circle, mcarlo.p_count, PI(mcarlo.p_count, mcarlo.p_within_circle));
-  /* Destroy the mutex, we don't using it anymore */
-  pthread_mutex_destroy(&lock);
-  return RETURN_SUCCESS;
+  if (mcarlo.epsilon > 0)
+    fprintf(out, "[%c] %s +/- %g after %llu points\n", mcarlo.stop ? '+' : '-',
+            mcarlo.stop ? "Converged to" : "Did not converge to", mcarlo.epsilon, mcarlo.p_count);
+  if (mcarlo.integrand != NULL)
+  {
+    fprintf(out, "[+] All Threads finished ! %llu points Integral = %.17g +/- %g (%.3f s, %.0f points/s)\n", mcarlo.p_count,
+            mcarlo.pi, stats_error(&mcarlo, &total), elapsed, mcarlo.p_count / elapsed);
+    if (!isnan(mcarlo.integrand->exact(mcarlo.dims, mcarlo.lower, mcarlo.upper)))
+      fprintf(out, "[~] Exact: %.15g\n", mcarlo.integrand->exact(mcarlo.dims, mcarlo.lower, mcarlo.upper));
+  }
+  else
+    fprintf(out, "[+] All Threads finished ! %llu/%llu PI = %f +/- %g (%.3f s, %.0f points/s)\n", mcarlo.p_within_circle,
+            mcarlo.p_count, mcarlo.pi, stats_error(&mcarlo, &total), elapsed, mcarlo.p_count / elapsed);
+  return mcarlo.epsilon > 0 && !mcarlo.stop ? RETURN_FAILURE : RETURN_SUCCESS;
+}
+
+/**
+ * --epsilon reached: the error bound over at least MIN_CHUNKS full chunks
+ * of every worker is under it
+ */
+static int                      converged(const t_mcarlo *mcarlo)
+{
+  t_stats                       total;
+
+  stats_snapshot(mcarlo, &total);
+  return total.chunks >= MIN_CHUNKS && stats_error(mcarlo, &total) < mcarlo->epsilon;
 }
 
 void                            *worker(void *arg)
 {
-  /* Casting the void* pointer to retrieve our t_mcarlo structure */
+  /* Casting the void* pointer to retrieve our t_thread structure */
   t_thread                      *thread = (t_thread *)arg;
-  double                        x = 0, y = 0;
+  t_mcarlo                      *mcarlo = thread->mcarlo;
+  unsigned long long            start, count;
+  uint64_t                      chunk;
+  double                        points[MAX_DIMS * BATCH_SIZE];
+  struct timespec               begin, end;
+  t_local                       *local;
 
-  while (1)
+  /* Pinned by now: the first touch places the pages of our counters on our node */
+  if ((local = mmap(NULL, sizeof(*local), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
   {
-    /* Creating random values (x, y coordinates) */
-    x = RANDOM_DOUBLE;
-    y = RANDOM_DOUBLE;
-
-    /* Locking the mutex, accessing shared memory */
-    pthread_mutex_lock(&lock);
-
-    if (!(thread->mcarlo->p_count < thread->mcarlo->p_todo))
-    {
-      pthread_mutex_unlock(&lock); /* Don't forget to unlock before leaving the loop */
-      break;
-    }
-
-    /* Increasing number of computed points */
-    if (++thread->mcarlo->p_count && WITHIN_CIRCLE(x, y)) /* Check is the coordinates are within the circle */
-      ++thread->mcarlo->p_within_circle;
-
-    /* Computed point in THIS tread */
-    ++thread->computed_points;
+    perror("mmap");
+    pthread_exit(NULL);
+  }
+  memset(local, 0, sizeof(*local));
+  __atomic_store_n(&thread->local, local, __ATOMIC_RELEASE);
+  clock_gettime(CLOCK_MONOTONIC, &begin);
 
-    /* Logging some info 10 times if we are in debug/progress mode */
-    if (PROGRESS && thread->mcarlo->p_count % ((thread->mcarlo->p_todo / 10) + 1) == 0)
-      printf("Progress: %llu/%llu -> %f\n",
-             thread->mcarlo->p_within_circle,
-             thread->mcarlo->p_count,
-             PI(thread->mcarlo->p_count, thread->mcarlo->p_within_circle)
-            );
-    /* Unlocking the mutex, not using shared memory anymore */
-    pthread_mutex_unlock(&lock);
+  /* CHUNK_SIZE points at a time, from our range of chunks then stolen from the others */
+  while (!__atomic_load_n(&mcarlo->stop, __ATOMIC_RELAXED) && scheduler_next(mcarlo, thread, &chunk))
+  {
+    start = chunk * CHUNK_SIZE;
+    count = (mcarlo->p_todo - start < CHUNK_SIZE ? mcarlo->p_todo - start : CHUNK_SIZE);
+    /* The random numbers of a chunk only depend on the seed and on the chunk */
+    mcarlo->prng->seed(&local->prng, mcarlo->seed, chunk);
+    /* Computed point in THIS tread, published for the reporter */
+    stats_commit(mcarlo, local, count, mcarlo->estimator->chunk(mcarlo, &local->prng, count, points));
+    if (mcarlo->epsilon > 0 && converged(mcarlo))
+      __atomic_store_n(&mcarlo->stop, 1, __ATOMIC_RELAXED);
   }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  local->elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
   /* Exiting at the end of the job */
   pthread_exit(NULL);
   return NULL;
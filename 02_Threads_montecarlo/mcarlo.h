@@ -0,0 +1,283 @@
+/**
+ * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
+ */
+#ifndef MCARLO_H_
+# define MCARLO_H_
+
+# include <stddef.h>
+# include <stdint.h>
+# include <time.h>
+# include <pthread.h>
+
+# define RETURN_SUCCESS         (0)
+# define RETURN_FAILURE         (1)
+# define THREAD_SUCCESS         (RETURN_SUCCESS)
+# define THREAD_FAILURE         (RETURN_FAILURE)
+# define SYSCALL_FAILURE        (-1)
+
+# define MAX_THREADS            (4096)
+
+/**
+ * The workers take CHUNK_SIZE points at a time from p_todo (at most
+ * MAX_CHUNKS chunks, see scheduler.c), and draw them BATCH_SIZE at a time.
+ * Per-thread data is padded to CACHE_LINE so no two workers write to the
+ * same line.
+ */
+# define CHUNK_SIZE             (1 << 16)
+# define MAX_CHUNKS             (0xFFFFFFFFULL)
+# define BATCH_SIZE             (1 << 10)
+# define CACHE_LINE             (64)
+
+/* x^2 + y^2 < 1 is the same test as sqrt(x^2 + y^2) < 1, without the sqrt */
+# define WITHIN_CIRCLE(x, y)    ((x) * (x) + (y) * (y) < 1)
+# define PI(a, b)               ((double)(4.0 * ((double)b / (double)a)))
+
+/**
+ * The reported error bound is ERROR_Z standard errors (95% confidence),
+ * over the estimates of the full chunks: --epsilon waits for MIN_CHUNKS
+ * of them before trusting it. The stratified estimator puts one point in
+ * each cell of a STRATA x STRATA grid per chunk.
+ */
+# define ERROR_Z                (1.96)
+# define MIN_CHUNKS             (32)
+# define STRATA                 (1 << 8)
+
+typedef unsigned __int128       t_u128;
+
+/**
+ * Integrands have up to MAX_DIMS dimensions. The sums of the chunks are
+ * added exactly, as two's complement integers of ACC_LIMBS words in units
+ * of ACC_LSB (the smallest double), so the total doesn't depend on the
+ * order they are added in (nor on the thread count) whatever their scale:
+ * the words hold any finite double with 64 bits to spare for the carries.
+ */
+# define MAX_DIMS               (16)
+# define ACC_LIMBS              (34)
+# define ACC_LSB                (-1074)
+
+typedef struct                  s_accumulator
+{
+  uint64_t                      limbs[ACC_LIMBS];
+}                               t_accumulator;
+
+/**
+ * State of one random stream, for any of the engines. Each chunk has its
+ * own stream of PRNG_STREAM numbers (2 per point).
+ *
+ * Points are drawn POINT_LANES at a time, as POINT_LANES x then POINT_LANES
+ * y: point i of a batch is (p[2 * POINT_LANES * (i / POINT_LANES) + i % POINT_LANES],
+ * the same + POINT_LANES), one vector of each for the SIMD kernels. xoshiro
+ * runs POINT_LANES interleaved generators, word w of lane l in xoshiro[w][l].
+ */
+# define PRNG_STREAM            (MAX_DIMS * CHUNK_SIZE)
+# define POINT_LANES            (8)
+# define POINT_ROUND(n)         (((n) + POINT_LANES - 1) / POINT_LANES * POINT_LANES)
+# define POINT_X(points, i)     ((points)[2 * POINT_LANES * ((i) / POINT_LANES) + (i) % POINT_LANES])
+# define POINT_Y(points, i)     ((points)[2 * POINT_LANES * ((i) / POINT_LANES) + (i) % POINT_LANES + POINT_LANES])
+
+/* Doubles of fill() in [-1, 1) to [0, 1) */
+# define UNIT(a)                (((a) + 1.0) * 0.5)
+
+typedef union                   u_prng
+{
+  uint64_t                      xoshiro[4][POINT_LANES];
+  struct
+  {
+    t_u128                      state;
+    t_u128                      inc;
+  }                             pcg;
+  struct
+  {
+    uint32_t                    key[2];
+    uint64_t                    stream;
+    uint64_t                    block;
+  }                             philox;
+}                               t_prng;
+
+/* seed() starts the stream of a chunk, fill() writes doubles in [-1, 1) */
+typedef struct                  s_prng_engine
+{
+  const char                    *name;
+  void                          (*seed)(t_prng *prng, uint64_t seed, uint64_t stream);
+  void                          (*fill)(t_prng *prng, double *out, size_t count);
+}                               t_prng_engine;
+
+typedef enum                    e_kernel_id
+{
+  KERNEL_AUTO = 0,
+  KERNEL_SCALAR,
+  KERNEL_AVX2,
+  KERNEL_AVX512,
+  KERNEL_COUNT
+}                               t_kernel_id;
+
+/**
+ * count() counts the points of a batch within the circle, draw() draws and
+ * counts `count` points straight from the xoshiro lanes (NULL: fill() then
+ * count()). The antithetic ones test each point as (u, v) and (1 - u, 1 - v)
+ * of the unit square, so `count` points are 2 * count tests. Every kernel
+ * is given the same points for a given seed (the FMA ones may round a
+ * point within an ulp of the circle the other way).
+ */
+typedef struct                  s_kernel
+{
+  const char                    *name;
+  unsigned long long            (*count)(const double *points, size_t count);
+  unsigned long long            (*draw)(t_prng *prng, size_t count);
+  unsigned long long            (*count_antithetic)(const double *points, size_t count);
+  unsigned long long            (*draw_antithetic)(t_prng *prng, size_t count);
+  const char                    *cpu_feature;
+}                               t_kernel;
+
+struct                          s_mcarlo;
+
+/**
+ * chunk() returns the sum over the `count` points of a chunk (the number
+ * within the circle for PI), its stream being seeded, using `points`
+ * (MAX_DIMS * BATCH_SIZE) as it likes. Each chunk is an independent
+ * estimate, whatever the estimator, so their spread is the error.
+ * whole_chunks ones round p_todo up.
+ */
+typedef struct                  s_estimator
+{
+  const char                    *name;
+  double                        (*chunk)(const struct s_mcarlo *mcarlo, t_prng *prng, size_t count, double *points);
+  int                           whole_chunks;
+}                               t_estimator;
+
+/**
+ * eval() writes in f the values of `count` points, coordinate d of point i
+ * being x[d * stride + i]. exact() is the integral over the bounds, NAN if
+ * it is not known for them.
+ */
+typedef struct                  s_integrand
+{
+  const char                    *name;
+  double                        lower;
+  double                        upper;
+  void                          (*eval)(const double *x, size_t stride, size_t count, unsigned int dims, double *f);
+  double                        (*exact)(unsigned int dims, const double *lower, const double *upper);
+}                               t_integrand;
+
+/**
+ * Points and the exact sum of the chunks, and the mean and sum of squared
+ * deviations (Welford) of the estimates of the full chunks: two of them
+ * merge exactly. `invalid` is set by a chunk sum which is not finite.
+ */
+typedef struct                  s_stats
+{
+  unsigned long long            points;
+  t_accumulator                 sum;
+  unsigned long long            chunks;
+  double                        mean;
+  double                        m2;
+  int                           invalid;
+}                               t_stats;
+
+/**
+ * An estimate is scale * sum / points: 4 * the hits for PI, the volume of
+ * the bounds times the mean of the integrand otherwise. p_count and
+ * p_within_circle are the merged results. `stop` is raised once --epsilon
+ * is reached.
+ */
+typedef struct                  s_mcarlo
+{
+  unsigned long long            p_todo;
+  unsigned long long            seed;
+  const t_prng_engine           *prng;
+  const t_kernel                *kernel;
+  const t_estimator             *estimator;
+  const t_integrand             *integrand;
+  unsigned int                  dims;
+  double                        lower[MAX_DIMS];
+  double                        upper[MAX_DIMS];
+  double                        scale;
+  double                        epsilon;
+  int                           stop;
+  unsigned int                  thread_count;
+  struct s_thread               *threads;
+  unsigned long long            p_count;
+  unsigned long long            p_within_circle;
+  double                        pi;
+}                               t_mcarlo;
+
+/**
+ * What a worker writes while it runs: its own pages, mapped and first
+ * touched by the worker once pinned so they are on its NUMA node. The
+ * stats are merged once it is done, and sampled meanwhile by the reporter
+ * and the --epsilon check: `seq` is odd while a chunk is being added.
+ */
+typedef struct                  s_local
+{
+  unsigned long long            seq;
+  t_stats                       stats;
+  double                        elapsed;
+  t_prng                        prng;
+}                               t_local;
+
+/**
+ * `range` holds the chunks [next, end) a thread has left to draw, end in
+ * the high 32 bits: the thread takes them from the front, the others
+ * steal from the back once they are done with theirs
+ */
+typedef struct                  s_thread
+{
+  uint64_t                      range;
+  pthread_t                     thread_id;
+  pthread_attr_t                thread_attr;
+  int                           index;
+  int                           cpu;
+  int                           status;
+  t_local                       *local;
+  t_mcarlo                      *mcarlo;
+} __attribute__((aligned(CACHE_LINE)))  t_thread;
+
+/* The reporter thread and what it last sampled */
+typedef struct                  s_report
+{
+  double                        interval;
+  int                           json;
+  pthread_t                     thread_id;
+  pthread_mutex_t               lock;
+  pthread_cond_t                cond;
+  int                           done;
+  struct timespec               start;
+  unsigned long long            last_points;
+  double                        last_time;
+  t_mcarlo                      *mcarlo;
+}                               t_report;
+
+/* Worker func ptr prototype */
+void                            *worker(void *arg);
+
+/* prng.c */
+const t_prng_engine             *prng_from_name(const char *name);
+int                             prng_is_xoshiro(const t_prng_engine *engine);
+
+/* report.c */
+void                            report_start(t_report *report, t_mcarlo *mcarlo);
+void                            report_stop(t_report *report);
+
+/* estimator.c */
+const t_estimator               *estimator_from_name(const char *name);
+double                          acc_value(const t_accumulator *acc);
+void                            stats_add(t_stats *stats, unsigned long long points, double sum, double scale);
+void                            stats_merge(t_stats *total, const t_stats *stats);
+double                          stats_value(const t_mcarlo *mcarlo, const t_stats *stats);
+double                          stats_error(const t_mcarlo *mcarlo, const t_stats *stats);
+void                            stats_commit(const t_mcarlo *mcarlo, t_local *local, unsigned long long points, double sum);
+void                            stats_snapshot(const t_mcarlo *mcarlo, t_stats *total);
+
+/* scheduler.c */
+void                            scheduler_init(t_mcarlo *mcarlo);
+int                             scheduler_next(t_mcarlo *mcarlo, t_thread *thread, uint64_t *chunk);
+
+/* integrand.c */
+extern const t_estimator        integrand_estimator;
+const t_integrand               *integrand_from_name(const char *name);
+
+/* kernel.c */
+const t_kernel                  *kernel_get(t_kernel_id id);
+t_kernel_id                     kernel_from_name(const char *name);
+
+#endif /* !MCARLO_H_ */
@@ -0,0 +1,206 @@
+/**
+ * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
+ *
+ * Per-thread random engines. Every chunk of points gets its own stream,
+ * derived from the --seed and the chunk index only, so an estimate can be
+ * reproduced whatever the number of threads and whichever thread drew
+ * which chunk.
+ */
+#include <string.h>
+#include "mcarlo.h"
+
+/**
+ * 52 random bits as the mantissa of a double in [1, 2), then 2d - 3 in
+ * [-1, 1) (exact): the SIMD kernels convert their lanes the same way
+ */
+static inline double            to_double(uint64_t x)
+{
+  union { uint64_t u; double d; } bits = {.u = (x >> 12) | 0x3FF0000000000000ULL};
+
+  return 2.0 * bits.d - 3.0;
+}
+#define TO_DOUBLE(x)            to_double(x)
+
+static inline uint64_t          rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64, to spread a seed over a whole state */
+static uint64_t                 splitmix64(uint64_t *x)
+{
+  uint64_t                      z = (*x += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * xoshiro256**, POINT_LANES interleaved generators: the state of lane l of
+ * a stream is the splitmix64 sequence of the seed mixed with the stream
+ * number and l (it has no cheap arbitrary jump)
+ */
+static void                     xoshiro_seed(t_prng *prng, uint64_t seed, uint64_t stream)
+{
+  uint64_t                      x;
+  int                           i, lane;
+
+  for (lane = 0 ; lane < POINT_LANES ; ++lane)
+  {
+    x = stream * POINT_LANES + lane;
+    x = seed ^ splitmix64(&x);
+    for (i = 0 ; i < 4 ; ++i)
+      prng->xoshiro[i][lane] = splitmix64(&x);
+  }
+}
+
+/* out[i] is drawn from lane i % POINT_LANES */
+static void                     xoshiro_fill(t_prng *prng, double *out, size_t count)
+{
+  uint64_t                      (*s)[POINT_LANES] = prng->xoshiro, t;
+  size_t                        i;
+  int                           lane;
+
+  for (i = 0 ; i < count ; i += POINT_LANES)
+    for (lane = 0 ; lane < POINT_LANES ; ++lane)
+    {
+      if (i + lane < count)
+        out[i + lane] = TO_DOUBLE(rotl(s[1][lane] * 5, 7) * 9);
+      t = s[1][lane] << 17;
+      s[2][lane] ^= s[0][lane];
+      s[3][lane] ^= s[1][lane];
+      s[1][lane] ^= s[2][lane];
+      s[0][lane] ^= s[3][lane];
+      s[2][lane] ^= t;
+      s[3][lane] = rotl(s[3][lane], 45);
+    }
+}
+
+/**
+ * PCG64 (XSL RR 128/64): one sequence per seed, the stream of a chunk
+ * starts PRNG_STREAM numbers after the previous one (advanced in log time)
+ */
+#define PCG_MULT        (((t_u128)0x2360ED051FC65DA4ULL << 64) | 0x4385DF649FCCF645ULL)
+
+static void                     pcg_advance(t_prng *prng, t_u128 delta)
+{
+  t_u128                        mult = PCG_MULT, plus = prng->pcg.inc;
+  t_u128                        acc_mult = 1, acc_plus = 0;
+
+  for (; delta > 0 ; delta >>= 1)
+  {
+    if (delta & 1)
+    {
+      acc_mult *= mult;
+      acc_plus = acc_plus * mult + plus;
+    }
+    plus *= mult + 1;
+    mult *= mult;
+  }
+  prng->pcg.state = acc_mult * prng->pcg.state + acc_plus;
+}
+
+static void                     pcg_seed(t_prng *prng, uint64_t seed, uint64_t stream)
+{
+  uint64_t                      x = seed, hi = splitmix64(&x), lo = splitmix64(&x);
+
+  prng->pcg.inc = (((t_u128)splitmix64(&x) << 64) | splitmix64(&x)) | 1;
+  prng->pcg.state = (((t_u128)hi << 64) | lo) + prng->pcg.inc;
+  pcg_advance(prng, (t_u128)stream * PRNG_STREAM);
+}
+
+static void                     pcg_fill(t_prng *prng, double *out, size_t count)
+{
+  t_u128                        state = prng->pcg.state;
+  uint64_t                      x;
+  size_t                        i;
+
+  for (i = 0 ; i < count ; ++i)
+  {
+    state = state * PCG_MULT + prng->pcg.inc;
+    x = (uint64_t)(state >> 64) ^ (uint64_t)state;
+    x = (x >> (state >> 122)) | (x << ((-(state >> 122)) & 63));
+    out[i] = TO_DOUBLE(x);
+  }
+  prng->pcg.state = state;
+}
+
+/**
+ * Philox4x32-10, counter based: the key is the seed, the counter is
+ * (stream, block) so streams never overlap
+ */
+static void                     philox_block(const uint32_t key_init[2], const uint32_t ctr_init[4], uint64_t out[2])
+{
+  uint32_t                      key[2] = {key_init[0], key_init[1]};
+  uint32_t                      ctr[4] = {ctr_init[0], ctr_init[1], ctr_init[2], ctr_init[3]};
+  uint64_t                      p0, p1;
+  int                           round;
+
+  for (round = 0 ; round < 10 ; ++round)
+  {
+    p0 = (uint64_t)0xD2511F53U * ctr[0];
+    p1 = (uint64_t)0xCD9E8D57U * ctr[2];
+    ctr[0] = (uint32_t)(p1 >> 32) ^ ctr[1] ^ key[0];
+    ctr[1] = (uint32_t)p1;
+    ctr[2] = (uint32_t)(p0 >> 32) ^ ctr[3] ^ key[1];
+    ctr[3] = (uint32_t)p0;
+    key[0] += 0x9E3779B9U;
+    key[1] += 0xBB67AE85U;
+  }
+  out[0] = ((uint64_t)ctr[0] << 32) | ctr[1];
+  out[1] = ((uint64_t)ctr[2] << 32) | ctr[3];
+}
+
+static void                     philox_seed(t_prng *prng, uint64_t seed, uint64_t stream)
+{
+  prng->philox.key[0] = (uint32_t)seed;
+  prng->philox.key[1] = (uint32_t)(seed >> 32);
+  prng->philox.stream = stream;
+  prng->philox.block = 0;
+}
+
+static void                     philox_fill(t_prng *prng, double *out, size_t count)
+{
+  uint32_t                      ctr[4];
+  uint64_t                      x[2];
+  size_t                        i;
+
+  ctr[2] = (uint32_t)prng->philox.stream;
+  ctr[3] = (uint32_t)(prng->philox.stream >> 32);
+  for (i = 0 ; i < count ; i += 2)
+  {
+    ctr[0] = (uint32_t)prng->philox.block;
+    ctr[1] = (uint32_t)(prng->philox.block++ >> 32);
+    philox_block(prng->philox.key, ctr, x);
+    out[i] = TO_DOUBLE(x[0]);
+    if (i + 1 < count)
+      out[i + 1] = TO_DOUBLE(x[1]);
+  }
+}
+
+static const t_prng_engine      engines[] =
+{
+  {"xoshiro", xoshiro_seed, xoshiro_fill},
+  {"pcg64", pcg_seed, pcg_fill},
+  {"philox", philox_seed, philox_fill},
+};
+
+/**
+ * Engine called `name`, NULL if there is none
+ */
+const t_prng_engine             *prng_from_name(const char *name)
+{
+  size_t                        i;
+
+  for (i = 0 ; i < sizeof(engines) / sizeof(*engines) ; ++i)
+    if (strcmp(engines[i].name, name) == 0)
+      return &engines[i];
+  return NULL;
+}
+
+/* The SIMD kernels draw the xoshiro lanes themselves */
+int                             prng_is_xoshiro(const t_prng_engine *engine)
+{
+  return engine == &engines[0];
+}
@@ -0,0 +1,122 @@
+/**
+ * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
+ *
+ * Progress reporter: a thread of its own wakes up every --report seconds
+ * and merges the stats the workers publish once per chunk (seqlocked,
+ * see stats_snapshot()). The workers never wait for it, nor print anything.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "mcarlo.h"
+
+static double                   since(const struct timespec *start, const struct timespec *now)
+{
+  return (now->tv_sec - start->tv_sec) + (now->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Estimate, ERROR_Z standard errors of it and the rate since the previous
+ * sample, as text or as a JSON line
+ */
+static void                     report_sample(t_report *report, int last)
+{
+  const t_mcarlo                *mcarlo = report->mcarlo;
+  unsigned long long            points, within;
+  struct timespec               now;
+  t_stats                       stats;
+  double                        elapsed, rate, value, error;
+
+  stats_snapshot(mcarlo, &stats);
+  points = stats.points;
+  within = (unsigned long long)acc_value(&stats.sum);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = since(&report->start, &now);
+  rate = (elapsed > report->last_time ? (points - report->last_points) / (elapsed - report->last_time) : 0.0);
+  report->last_points = points;
+  report->last_time = elapsed;
+  value = (points > 0 ? stats_value(mcarlo, &stats) : 0.0);
+  error = stats_error(mcarlo, &stats);
+  if (report->json && mcarlo->integrand != NULL)
+    printf("{\"time\": %.3f, \"points\": %llu, \"todo\": %llu, \"integral\": %.15g, \"error\": %.9g, "
+           "\"rate\": %.0f, \"final\": %s}\n", elapsed, points, mcarlo->p_todo, value, error, rate,
+           last ? "true" : "false");
+  else if (report->json)
+    printf("{\"time\": %.3f, \"points\": %llu, \"todo\": %llu, \"within\": %llu, \"pi\": %.9f, \"error\": %.9g, "
+           "\"rate\": %.0f, \"final\": %s}\n", elapsed, points, mcarlo->p_todo, within, value,
+           error, rate, last ? "true" : "false");
+  else
+    printf("[~] Progress: %llu/%llu %s = %f +/- %f (%.0f points/s)\n", points, mcarlo->p_todo,
+           mcarlo->integrand != NULL ? "Integral" : "PI", value, error, rate);
+  fflush(stdout);
+}
+
+static void                     *reporter(void *arg)
+{
+  t_report                      *report = (t_report *)arg;
+  struct timespec               wake = report->start;
+  double                        step;
+
+  pthread_mutex_lock(&report->lock);
+  while (!report->done)
+  {
+    step = wake.tv_nsec + report->interval * 1e9;
+    wake.tv_sec += (time_t)(step / 1e9);
+    wake.tv_nsec = (long)fmod(step, 1e9);
+    while (!report->done && pthread_cond_timedwait(&report->cond, &report->lock, &wake) == 0)
+      ;
+    if (!report->done)
+      report_sample(report, 0);
+  }
+  pthread_mutex_unlock(&report->lock);
+  return NULL;
+}
+
+/**
+ * Starts the reporter over the workers of `mcarlo` (nothing to do if its
+ * interval is 0)
+ */
+void                            report_start(t_report *report, t_mcarlo *mcarlo)
+{
+  pthread_condattr_t            attr;
+
+  report->mcarlo = mcarlo;
+  report->done = 0;
+  report->last_points = 0;
+  report->last_time = 0.0;
+  clock_gettime(CLOCK_MONOTONIC, &report->start);
+  if (report->interval <= 0)
+    return;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&report->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&report->lock, NULL);
+  if (pthread_create(&report->thread_id, NULL, reporter, report) != RETURN_SUCCESS)
+  {
+    fprintf(stderr, "[-] Failed to start the reporter thread\n");
+    pthread_cond_destroy(&report->cond);
+    pthread_mutex_destroy(&report->lock);
+    report->interval = 0;
+  }
+}
+
+/**
+ * Stops the reporter once the workers are joined, with a last sample of
+ * the final counts in JSON mode
+ */
+void                            report_stop(t_report *report)
+{
+  if (report->interval > 0)
+  {
+    pthread_mutex_lock(&report->lock);
+    report->done = 1;
+    pthread_cond_signal(&report->cond);
+    pthread_mutex_unlock(&report->lock);
+    pthread_join(report->thread_id, NULL);
+    pthread_cond_destroy(&report->cond);
+    pthread_mutex_destroy(&report->lock);
+  }
+  if (report->json)
+    report_sample(report, 1);
+}
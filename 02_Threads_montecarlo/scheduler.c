@@ -0,0 +1,70 @@
+/**
+ * Monte Carlo - Threads exercise - CSUSM - Erwan Dupard
+ *
+ * Work stealing chunk scheduler: the chunks are split in one contiguous
+ * range per thread up front. A thread takes the chunks of its own range
+ * from the front, then steals the back half of the range of another one,
+ * so there is no shared counter to bounce between the cores until the
+ * end, and the chunks of a thread which didn't start are still drawn.
+ * A range is a single 64 bits word, both ends are moved by one CAS.
+ */
+#include "mcarlo.h"
+
+#define RANGE(next, end)        (((uint64_t)(end) << 32) | (uint32_t)(next))
+#define RANGE_NEXT(range)       ((uint32_t)(range))
+#define RANGE_END(range)        ((uint32_t)((range) >> 32))
+
+void                            scheduler_init(t_mcarlo *mcarlo)
+{
+  uint64_t                      chunks = (mcarlo->p_todo + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  unsigned int                  i, count = mcarlo->thread_count;
+
+  for (i = 0 ; i < count ; ++i)
+    mcarlo->threads[i].range = RANGE(chunks * i / count, chunks * (i + 1) / count);
+}
+
+/* The back half of the victim's range (rounded up), 0 if it has none left */
+static int                      steal(t_thread *victim, uint64_t *next, uint64_t *end)
+{
+  uint64_t                      range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+  uint64_t                      half;
+
+  do
+  {
+    if (RANGE_NEXT(range) >= RANGE_END(range))
+      return 0;
+    half = (RANGE_END(range) - RANGE_NEXT(range) + 1) / 2;
+  } while (!__atomic_compare_exchange_n(&victim->range, &range, RANGE(RANGE_NEXT(range), RANGE_END(range) - half),
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  *next = RANGE_END(range) - half;
+  *end = RANGE_END(range);
+  return 1;
+}
+
+/**
+ * Next chunk of `thread`, from its range or stolen: 0 once every range is
+ * empty (a stolen range is the thief's to draw, so none is ever lost)
+ */
+int                             scheduler_next(t_mcarlo *mcarlo, t_thread *thread, uint64_t *chunk)
+{
+  uint64_t                      range = __atomic_load_n(&thread->range, __ATOMIC_ACQUIRE);
+  uint64_t                      next, end;
+  unsigned int                  i;
+
+  while (RANGE_NEXT(range) < RANGE_END(range))
+    if (__atomic_compare_exchange_n(&thread->range, &range, RANGE(RANGE_NEXT(range) + 1, RANGE_END(range)),
+                                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      *chunk = RANGE_NEXT(range);
+      return 1;
+    }
+  /* Our range is empty, nobody steals from it until it is refilled */
+  for (i = 1 ; i < mcarlo->thread_count ; ++i)
+    if (steal(&mcarlo->threads[(thread->index + i) % mcarlo->thread_count], &next, &end))
+    {
+      __atomic_store_n(&thread->range, RANGE(next + 1, end), __ATOMIC_RELEASE);
+      *chunk = next;
+      return 1;
+    }
+  return 0;
+}